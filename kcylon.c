@@ -12,12 +12,34 @@
 #include <linux/module.h>
 #include <linux/kernel.h>
 #include <linux/gpio.h>
+#include <linux/gpio/consumer.h>
+#include <linux/gpio/driver.h>
 #include <linux/kobject.h>
 #include <linux/kthread.h>
 #include <linux/mutex.h>
 #include <linux/interrupt.h>
 #include <linux/time.h>
 #include <linux/delay.h>
+#include <linux/ktime.h>
+#include <linux/percpu.h>
+#include <linux/bitmap.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/spinlock.h>
+#include <linux/uaccess.h>
+#include <linux/hrtimer.h>
+#include <linux/atomic.h>
+#include <linux/slab.h>
+#include <linux/mm.h>
+#include <linux/workqueue.h>
+#include <linux/miscdevice.h>
+#include <linux/fs.h>
+#include <linux/poll.h>
+#include <linux/wait.h>
+#include <linux/kernel_stat.h>
+#include <linux/cpumask.h>
+#include <linux/firmware.h>
+#include <linux/smp.h>
 
 MODULE_LICENSE("GPL");
 MODULE_AUTHOR("Benjamin James");
@@ -27,9 +49,74 @@ MODULE_VERSION("0.2");
 #define NUM_LEDS 10
 
 /**
- * @brief LED pin assignments
+ * @brief Upper bound on LEDs in one strip, so a frame fits in a
+ * fixed size bitmap
  */
-static unsigned int led_pins[NUM_LEDS] = {
+#define KCYLON_MAX_LEDS 64
+
+/**
+ * @brief Upper bound on the number of strips the engine drives
+ */
+#define KCYLON_MAX_STRIPS 4
+
+/**
+ * @brief Number of input events kept by the trace ring. Must
+ * be a power of two.
+ */
+#define KCYLON_TRACE_LEN 1024
+
+/**
+ * @brief Bits of brightness per LED. Brightness is shown by
+ * bit angle modulation: plane k of a frame is held for 2^k
+ * slots of a refresh period of KCYLON_BAM_SLOTS slots.
+ */
+#define KCYLON_BAM_BITS 4
+#define KCYLON_BAM_SLOTS ((1 << KCYLON_BAM_BITS) - 1)
+
+/**
+ * @brief Number of keyframes a segment can have queued
+ */
+#define KCYLON_MAX_KEYFRAMES 16
+
+/**
+ * @brief Upper bound on the GPIO chips one strip spans
+ */
+#define KCYLON_MAX_BANKS 8
+
+/**
+ * @brief Upper bound on the independently animated segments
+ * of one strip
+ */
+#define KCYLON_MAX_SEGMENTS 4
+
+/**
+ * @brief Upper bound on the rows and on the columns of the
+ * keypad matrix
+ */
+#define KCYLON_MATRIX_MAX 8
+
+/**
+ * @brief Number of overlay layers a strip can stack on top
+ * of its base pattern
+ */
+#define KCYLON_MAX_LAYERS 4
+
+/**
+ * @brief Number of speed levels, -10 to 10
+ */
+#define KCYLON_LEVELS 21
+
+/**
+ * @brief Longest period in milliseconds a config may give a
+ * speed level
+ */
+#define KCYLON_PERIOD_MAX_MS 60000
+
+/**
+ * @brief LED pin assignments, and how many of them strip 0 has
+ */
+static unsigned int num_led_pins = NUM_LEDS;
+static unsigned int led_pins[KCYLON_MAX_LEDS] = {
 	65,
 	46,
 	26,
@@ -43,141 +130,3118 @@ static unsigned int led_pins[NUM_LEDS] = {
 };
 
 /**
- * @brief The pin of the button used for input
+ * @brief How strip 0 is split into segments, each animated on
+ * its own: the number of LEDs in each, first LED first, and
+ * the pattern and level each starts with. Without any, the
+ * whole strip is one segment.
+ */
+static unsigned int segment_leds[KCYLON_MAX_SEGMENTS];
+static unsigned int num_segment_leds;
+module_param_array(segment_leds, uint, &num_segment_leds, 0444);
+MODULE_PARM_DESC(segment_leds, "LEDs in each segment of strip 0");
+static unsigned int segment_patterns[KCYLON_MAX_SEGMENTS];
+static unsigned int num_segment_patterns;
+module_param_array(segment_patterns, uint, &num_segment_patterns, 0444);
+MODULE_PARM_DESC(segment_patterns, "Starting pattern of each segment of strip 0");
+static int segment_levels[KCYLON_MAX_SEGMENTS];
+static unsigned int num_segment_levels;
+module_param_array(segment_levels, int, &num_segment_levels, 0444);
+MODULE_PARM_DESC(segment_levels, "Starting speed level of each segment of strip 0");
+static unsigned int segment_speeds[KCYLON_MAX_SEGMENTS];
+static unsigned int num_segment_speeds;
+module_param_array(segment_speeds, uint, &num_segment_speeds, 0444);
+MODULE_PARM_DESC(segment_speeds, "What sets the speed of each segment of strip 0: 0 its level, 1 CPU load, 2 block I/O, 3 interrupt rate");
+
+/**
+ * @brief Rates at which a segment following block I/O
+ * completions or interrupts runs at full speed, per second,
+ * and how slowly the metrics are smoothed, as the shift of
+ * the weight given to each new sample
+ */
+static unsigned int speed_block_full = 1000;
+module_param(speed_block_full, uint, 0644);
+MODULE_PARM_DESC(speed_block_full, "Block I/O completions per second for full speed");
+static unsigned int speed_irq_full = 20000;
+module_param(speed_irq_full, uint, 0644);
+MODULE_PARM_DESC(speed_irq_full, "Interrupts per second for full speed");
+static unsigned int speed_smoothing = 2;
+module_param(speed_smoothing, uint, 0644);
+MODULE_PARM_DESC(speed_smoothing, "Each sweep's sample is weighted 1/2^speed_smoothing (default 2)");
+
+/**
+ * @brief The pin of the button used for input
+ */
+static unsigned int button_pin = 27;
+
+/**
+ * @brief The segment of strip 0 the button controls
+ */
+static unsigned int button_segment;
+module_param(button_segment, uint, 0444);
+MODULE_PARM_DESC(button_segment, "Segment of strip 0 the button controls");
+
+/**
+ * @brief The default sleep time in milliseconds
+ */
+static unsigned int sleep_time = 100;
+
+/**
+ * @brief Period in milliseconds of each speed level, level
+ * -10 first. Filled from sleep_time unless a config gives it.
+ */
+static unsigned int speed_table[KCYLON_LEVELS];
+
+/**
+ * @brief Firmware file holding a config blob to apply at load
+ */
+static char *config;
+module_param(config, charp, 0444);
+MODULE_PARM_DESC(config, "Firmware file with a config blob to apply at load");
+
+/**
+ * @brief Rate at which frames are rendered when the beams
+ * move smoothly, in Hz. 0 moves them a whole LED per frame.
+ */
+static unsigned int refresh_hz;
+module_param(refresh_hz, uint, 0444);
+MODULE_PARM_DESC(refresh_hz, "Render at this rate with sub-LED beam positions, 25-400 (default 0, off)");
+
+/**
+ * @brief How long the level bar stays up after a button
+ * press, in milliseconds
+ */
+static unsigned int level_bar_ms = 1000;
+
+/**
+ * @brief How long the acknowledgement flash of a button
+ * press lasts, and the minimum time between two of them,
+ * in milliseconds
+ */
+static unsigned int ack_ms = 40;
+static unsigned int ack_interval_ms = 150;
+
+/**
+ * @brief Speed up factor when replaying a trace, 1 replays
+ * it in real time
+ */
+static unsigned int replay_speed = 1;
+module_param(replay_speed, uint, 0644);
+MODULE_PARM_DESC(replay_speed, "Speed up factor for replayed traces (default 1)");
+
+/**
+ * @brief GPIOs of an optional strip of common cathode RGB
+ * LEDs, as red, green, blue triplets, first LED first. If
+ * given, it is driven as strip 1.
+ */
+static unsigned int rgb_pins[KCYLON_MAX_LEDS / 3 * 3];
+static unsigned int num_rgb_pins;
+module_param_array(rgb_pins, uint, &num_rgb_pins, 0444);
+MODULE_PARM_DESC(rgb_pins, "GPIOs of an RGB strip as red,green,blue triplets");
+
+/**
+ * @brief Colours of the RGB strip's brightness levels, as
+ * 0xRGB with 4 bits per channel. Brightness 0 is off and by
+ * default the levels ramp up in red, like the LEDs of strip 0.
+ */
+static unsigned short rgb_palette[1 << KCYLON_BAM_BITS];
+static unsigned int num_rgb_palette;
+module_param_array(rgb_palette, ushort, &num_rgb_palette, 0444);
+MODULE_PARM_DESC(rgb_palette, "0xRGB colour of each brightness level of the RGB strip");
+
+/**
+ * @brief The RGB strip's pins, reordered all reds, then all
+ * greens, then all blues
+ */
+static unsigned int rgb_outputs[KCYLON_MAX_LEDS];
+
+/**
+ * @brief An optional input sampled once per frame, such as a
+ * photodiode seeing the beam reflected, the strip whose frames
+ * it follows and how long after a frame is written it is read,
+ * in microseconds
+ */
+static int sense_pin = -1;
+module_param(sense_pin, int, 0444);
+MODULE_PARM_DESC(sense_pin, "GPIO sampled after each frame to build an occupancy map (default -1, none)");
+static unsigned int sense_strip;
+module_param(sense_strip, uint, 0444);
+MODULE_PARM_DESC(sense_strip, "Strip whose frames the sense GPIO follows");
+static unsigned int sense_segment;
+module_param(sense_segment, uint, 0444);
+MODULE_PARM_DESC(sense_segment, "Segment of the sense strip whose beam the sense GPIO follows");
+static unsigned int sense_offset_us = 200;
+module_param(sense_offset_us, uint, 0644);
+MODULE_PARM_DESC(sense_offset_us, "Delay from a frame's write to sampling the sense GPIO");
+
+/**
+ * @brief Slack the engine allows on its frame deadlines, in
+ * microseconds
+ */
+static unsigned int frame_slack_us = 50;
+
+/**
+ * @brief Keypad matrix pins. The rows are driven and the
+ * columns read, so key (r, c) connects row r to column c.
+ * The matrix is unused unless both are given.
+ */
+static unsigned int matrix_rows[KCYLON_MATRIX_MAX];
+static unsigned int num_matrix_rows;
+module_param_array(matrix_rows, uint, &num_matrix_rows, 0444);
+MODULE_PARM_DESC(matrix_rows, "GPIOs driving the keypad matrix rows");
+static unsigned int matrix_cols[KCYLON_MATRIX_MAX];
+static unsigned int num_matrix_cols;
+module_param_array(matrix_cols, uint, &num_matrix_cols, 0444);
+MODULE_PARM_DESC(matrix_cols, "GPIOs reading the keypad matrix columns");
+
+/**
+ * @brief What each key of the matrix does, row by row, as
+ * (segment << 16) | (strip << 8) | command. Without a keymap,
+ * row r controls strip r and the columns are faster, slower
+ * and pattern.
+ */
+static unsigned int matrix_keymap[KCYLON_MATRIX_MAX * KCYLON_MATRIX_MAX];
+static unsigned int num_matrix_keymap;
+module_param_array(matrix_keymap, uint, &num_matrix_keymap, 0444);
+MODULE_PARM_DESC(matrix_keymap, "Per key (segment << 16) | (strip << 8) | command");
+
+/**
+ * @brief Keypad scan period in milliseconds, how many scans
+ * a key must read the same before it changes state, and how
+ * long the columns take to settle after a row is driven in
+ * microseconds
+ */
+static unsigned int matrix_scan_ms = 5;
+static unsigned int matrix_debounce = 4;
+static unsigned int matrix_settle_us = 10;
+
+/**
+ * @brief Held while the config is replaced, and by everything
+ * outside the engine which looks strips or segments up by
+ * number. Whether the strips, button and engine are up, and
+ * whether a config is being applied.
+ */
+static DEFINE_MUTEX(config_mutex);
+static bool kcylon_running;
+static bool config_applying;
+
+/**
+ * @brief The ID of the button for the IRQ interrupts
+ */
+static int irq_number;
+
+/**
+ * @brief Adaptive polling of the button line: poll_burst
+ * edges within poll_window_ms mask its IRQ, and it is then
+ * polled every poll_interval_us until it has seen no edge for
+ * poll_quiet_ms. 0 edges keeps it on its IRQ.
+ */
+static unsigned int poll_burst = 8;
+module_param(poll_burst, uint, 0644);
+MODULE_PARM_DESC(poll_burst, "Button edges within poll_window_ms which switch it to polling, 0 never (default 8)");
+static unsigned int poll_window_ms = 20;
+module_param(poll_window_ms, uint, 0644);
+MODULE_PARM_DESC(poll_window_ms, "Window the burst of edges is counted over");
+static unsigned int poll_interval_us = 1000;
+module_param(poll_interval_us, uint, 0644);
+MODULE_PARM_DESC(poll_interval_us, "How often the button is polled in a burst, at least 100");
+static unsigned int poll_quiet_ms = 100;
+module_param(poll_quiet_ms, uint, 0644);
+MODULE_PARM_DESC(poll_quiet_ms, "Time without edges after which the button goes back to its IRQ");
+
+/**
+ * @brief Polling state of the button: the timer polling it,
+ * whether it is polled, whether it is being torn down, the
+ * burst being counted, the level it was last polled at and
+ * when it last saw an edge
+ */
+static struct hrtimer button_poll_timer;
+static bool button_polling;
+static bool button_stopping;
+static unsigned int button_burst;
+static ktime_t button_burst_start;
+static int button_poll_level;
+static ktime_t button_poll_edge;
+
+/**
+ * @brief The struct containing info on the worker thread
+ */
+static struct task_struct *task;
+
+/**
+ * @brief Benchmarking variables: when the button was last
+ * pressed and the interval between the last two presses
+ */
+static ktime_t press_last;
+static s64 press_interval_ns;
+
+/**
+ * @brief When the edge being handled by the IRQ thread was
+ * seen by the hard IRQ handler. The line stays masked until
+ * the thread is done, so there is only ever one.
+ */
+static ktime_t press_edge;
+
+/**
+ * @brief Keep the button IRQ on the CPU the engine runs on, so
+ * a press wakes the engine without an IPI, the CPU it was last
+ * put on (-1 if it isn't kept there) and the affinity it had
+ * before, which it gets back when it is let go
+ */
+static bool colocate = true;
+module_param(colocate, bool, 0644);
+MODULE_PARM_DESC(colocate, "Keep the button IRQ on the engine thread's CPU (default 1)");
+static int engine_cpu = -1;
+static struct cpumask irq_home;
+
+/**
+ * @brief Where an input event came from
+ */
+enum kcylon_source {
+	KCYLON_SRC_BUTTON,	/**< the button interrupt */
+	KCYLON_SRC_REPLAY,	/**< a replayed trace */
+	KCYLON_SRC_MATRIX,	/**< a key of the keypad matrix */
+};
+
+/**
+ * @brief What an input event asks a strip to do
+ */
+enum kcylon_cmd {
+	KCYLON_CMD_PRESS,	/**< step the level, turning round at the ends */
+	KCYLON_CMD_FASTER,
+	KCYLON_CMD_SLOWER,
+	KCYLON_CMD_PATTERN,	/**< switch to the next pattern */
+	KCYLON_CMD_MAX,
+};
+
+/**
+ * @brief One recorded input event
+ *
+ * This is also the on-disk format of a dumped trace, after a
+ * struct kcylon_trace_header, in native byte order.
+ */
+struct kcylon_trace_entry {
+	u64 time_ns;	/**< ktime of the edge */
+	u32 seq;	/**< event number, 1 based */
+	u8 source;	/**< enum kcylon_source */
+	u8 strip;
+	s8 level;	/**< button level after the event */
+	s8 direction;	/**< button direction after the event */
+	u8 cmd;	/**< enum kcylon_cmd */
+	u8 segment;
+	u8 reserved[6];
+};
+
+/**
+ * @brief Header of a dumped or replayed trace
+ */
+struct kcylon_trace_header {
+	u32 magic;	/**< KCYLON_TRACE_MAGIC */
+	u16 version;	/**< KCYLON_TRACE_VERSION */
+	u16 entry_size;	/**< sizeof(struct kcylon_trace_entry) */
+	u32 count;	/**< entries following the header */
+	u32 reserved;
+};
+
+#define KCYLON_TRACE_MAGIC 0x5254434b	/* "KCTR" */
+#define KCYLON_TRACE_VERSION 2
+
+/**
+ * @brief Ring of the last KCYLON_TRACE_LEN input events
+ *
+ * Producers claim a slot by incrementing trace_head and
+ * publish it by writing its seq last. Readers copy a slot and
+ * keep it only if its seq is the expected one both before and
+ * after the copy, so neither side ever takes a lock.
+ */
+static struct kcylon_trace_entry trace_ring[KCYLON_TRACE_LEN];
+static atomic_t trace_head = ATOMIC_INIT(0);
+
+/**
+ * @brief The thread replaying a trace, if one is running, and
+ * the trace it replays
+ */
+static struct task_struct *replay_task;
+static struct kcylon_trace_entry *replay_entries;
+static unsigned int replay_count;
+static DEFINE_MUTEX(replay_mutex);
+
+/**
+ * @brief Replayed events whose resulting state differed from
+ * the one recorded in the trace
+ */
+static unsigned int replay_divergences;
+
+/**
+ * @brief Cost counters for one strip on one CPU
+ *
+ * Everything the engine does on behalf of a strip is charged
+ * here, so the totals can be used for power budgeting.
+ */
+struct kcylon_stats {
+	u64 wakeups;	/**< times the engine woke up for this strip */
+	u64 frames;	/**< frames rendered */
+	u64 frame_ns;	/**< ns spent rendering and writing frames */
+	u64 gpio_writes;	/**< batched GPIO chip writes issued */
+	u64 gpio_ns;	/**< ns spent inside GPIO writes */
+	u64 irqs;	/**< button interrupts handled */
+	u64 irq_ns;	/**< ns spent in the interrupt handler */
+	u64 metric_samples;	/**< system metrics sampled for speed */
+	u64 metric_ns;	/**< ns spent sampling them */
+	u64 polls;	/**< button polls while its IRQ was masked */
+	u64 poll_edges;	/**< button presses found by polling */
+	u64 poll_ns;	/**< ns spent polling */
+};
+
+/**
+ * @brief How an overlay layer is combined with the frame
+ * below it, within the layer's mask
+ */
+enum kcylon_blend {
+	KCYLON_BLEND_OR,	/**< light the layer's LEDs */
+	KCYLON_BLEND_XOR,	/**< invert under the layer's LEDs */
+	KCYLON_BLEND_REPLACE,	/**< show only the layer */
+};
+
+/**
+ * @brief Who owns an overlay layer. Pushing a layer with the
+ * tag of a live one replaces it rather than stacking another.
+ */
+enum kcylon_layer_tag {
+	KCYLON_LAYER_USER = 1,	/**< layers pushed through debugfs */
+	KCYLON_LAYER_LEVEL,	/**< the level bar of segment 0, then 1... */
+};
+
+/**
+ * @brief A transient bitmap shown on top of the base pattern
+ */
+struct kcylon_layer {
+	DECLARE_BITMAP(bits, KCYLON_MAX_LEDS);
+	DECLARE_BITMAP(mask, KCYLON_MAX_LEDS);	/**< LEDs the layer covers */
+	enum kcylon_blend blend;
+	int tag;
+	ktime_t start;
+	ktime_t expires;	/**< KTIME_MAX if the layer never expires */
+	unsigned int blink_ms;	/**< 0 for steady, else the half period */
+};
+
+/**
+ * @brief A frame with brightness, as one bitmap per bit of
+ * brightness, least significant first
+ */
+struct kcylon_frame {
+	DECLARE_BITMAP(plane[KCYLON_BAM_BITS], KCYLON_MAX_LEDS);
+};
+
+/**
+ * @brief A keyframe as written to /dev/kcylon
+ *
+ * Writes to the device are a sequence of these. Each one is
+ * queued on its segment, which switches to the keyframes
+ * pattern, and is reached delay_ms after the one before it
+ * (or after it was written, if the queue was empty).
+ */
+struct kcylon_keyframe {
+	u32 delay_ms;
+	u8 strip;
+	u8 segment;
+	u8 count;	/**< intensities given, from the segment's first LED */
+	u8 reserved;
+	u8 intensity[KCYLON_MAX_LEDS];	/**< 0 to 255 */
+};
+
+/**
+ * @brief The keyframes queued on a segment and the one it
+ * has most recently reached
+ */
+struct kcylon_keyframes {
+	u8 from[KCYLON_MAX_LEDS];	/**< intensities at the keyframe reached */
+	ktime_t from_time;	/**< when it was reached */
+	struct {
+		u32 delay_ms;
+		u8 intensity[KCYLON_MAX_LEDS];
+	} queue[KCYLON_MAX_KEYFRAMES];
+	unsigned int head;
+	unsigned int count;
+};
+
+/**
+ * @brief A range of a strip's LEDs animated on its own
+ */
+struct kcylon_segment {
+	unsigned int first;	/**< the segment's first LED in the strip */
+	unsigned int num_leds;
+	int current_led;	/**< relative to first */
+	bool rising;
+	u32 phase;	/**< position along the pattern in 1/65536 LEDs, if smooth */
+	u32 sweeps;	/**< trips there and back completed */
+	unsigned int pattern;	/**< index into patterns[] */
+	int level;	/**< speed level, positive is slower, as last taken from cmds */
+	atomic64_t cmds;	/**< commands folded by kcylon_strip_command() */
+	atomic64_t cmd_edge;	/**< edge in ns of the first command not yet taken, or 0 */
+	unsigned int speed;	/**< enum kcylon_speed, what sets the period */
+	u64 metric_busy;	/**< the metric's counters at the last sample */
+	u64 metric_total;
+	ktime_t metric_stamp;
+	u32 metric_load;	/**< the smoothed metric, 65536 is full speed */
+	ktime_t deadline;	/**< when the segment's next frame is due */
+	struct kcylon_keyframes kf;	/**< protected by the strip's out_lock */
+};
+
+/**
+ * @brief What sets a segment's speed: its level, changed by
+ * presses, or a system metric sampled once per sweep
+ */
+enum kcylon_speed {
+	KCYLON_SPEED_LEVEL,
+	KCYLON_SPEED_CPU,	/**< busy share of all online CPUs' time */
+	KCYLON_SPEED_BLOCK,	/**< block softirqs, about one per batch of completions */
+	KCYLON_SPEED_IRQ,	/**< hard interrupts on all online CPUs */
+	KCYLON_SPEED_MAX,
+};
+
+static const char *const speed_names[KCYLON_SPEED_MAX] = {
+	"level", "cpu", "block", "irq",
+};
+
+/**
+ * @brief The LEDs of a strip which sit on one GPIO chip, so
+ * they can be written together
+ */
+struct kcylon_bank {
+	struct gpio_chip *chip;
+	struct gpio_desc *descs[KCYLON_MAX_LEDS];
+	unsigned int leds[KCYLON_MAX_LEDS];	/**< the strip LED of each desc */
+	unsigned int count;
+	DECLARE_BITMAP(mask, KCYLON_MAX_LEDS);	/**< the strip LEDs on this chip */
+	bool cansleep;
+};
+
+/**
+ * @brief One physical strip of LEDs and the state of its beams
+ *
+ * A strip's pins may span several GPIO chips. They are taken
+ * in order as one logical strip, and written as one batch per
+ * chip.
+ *
+ * An RGB strip has three outputs per LED, ordered by channel:
+ * output c * num_leds + i is channel c of LED i. Its frames
+ * are rendered as for any other strip, each LED's brightness
+ * being an index into its palette, and only expanded into
+ * the outputs' planes when they are shown.
+ */
+struct kcylon_strip {
+	unsigned int *pins;	/**< GPIO numbers, output 0 first */
+	unsigned int num_leds;
+	unsigned int num_outputs;	/**< num_leds, or 3 * num_leds if rgb */
+	bool rgb;
+	u16 palette[1 << KCYLON_BAM_BITS];	/**< 0xRGB of each brightness, if rgb */
+	struct kcylon_bank banks[KCYLON_MAX_BANKS];
+	unsigned int num_banks;
+	struct kcylon_segment segments[KCYLON_MAX_SEGMENTS];
+	unsigned int num_segments;
+	ktime_t deadline;	/**< the earliest deadline of the segments */
+	DECLARE_BITMAP(shown, KCYLON_MAX_LEDS);	/**< what the GPIOs show */
+	struct kcylon_stats __percpu *stats;
+	struct kcylon_stats rate;	/**< per-second rate over the last window */
+	struct kcylon_stats rate_base;	/**< totals at the start of the window */
+	ktime_t rate_stamp;	/**< start of the current window */
+	struct kcylon_layer layers[KCYLON_MAX_LAYERS];	/**< bottom first */
+	unsigned int num_layers;
+	spinlock_t layer_lock;	/**< layers are pushed from IRQ context */
+	struct kcylon_frame base;	/**< the last frame before overlays */
+	struct kcylon_frame out;	/**< the outputs being shown, after overlays */
+	int bam_plane;	/**< the next plane of out to show, or -1 */
+	ktime_t bam_deadline;	/**< when that plane is due */
+	ktime_t bam_end;	/**< when the current refresh period ends */
+	ktime_t next_change;	/**< when the frame next changes visibly */
+	bool redraw;	/**< set when a layer is pushed, to recompose at once */
+	struct mutex out_lock;	/**< serialises writes of the engine and acks */
+	ktime_t ack_last;	/**< when the last acknowledgement was shown */
+	u64 acks;
+	u64 ack_latency_ns;	/**< total edge to GPIO write latency of acks */
+	u64 ack_latency_max_ns;
+	u64 cmds_taken;	/**< commands applied by the engine */
+	u64 cmds_frames;	/**< frames they were applied at */
+	u64 cmd_edge;	/**< edge in ns of the earliest command taken for the next write, or 0 */
+	u64 cmd_latency_last_ns;	/**< edge to frame write latency of commands */
+	u64 cmd_latency_ns[2];	/**< totals with the IRQ spread, and co-located */
+	u64 cmd_latency_max_ns[2];
+	u64 cmd_latencies[2];
+	u64 on_ns[KCYLON_MAX_LEDS];	/**< time each output has been lit, until on_since */
+	u64 on_since[KCYLON_MAX_LEDS];	/**< when each lit output was turned on */
+	u64 lit_ns;	/**< integral of lit outputs over time, until shown_since */
+	u64 shown_since;	/**< when shown was last written */
+	u64 ontime_start;	/**< when the on-time counters started */
+};
+
+/**
+ * @brief The strips driven by the engine. Strip 0 is made
+ * of led_pins and is the one the button controls.
+ */
+static struct kcylon_strip strips[KCYLON_MAX_STRIPS];
+static unsigned int num_strips = 1;
+
+/**
+ * @brief A built-in animation
+ *
+ * step() renders a segment into its range of a bitmap, which
+ * is clear there, for its current position and the time now,
+ * and then moves the position on. smooth() does the same with
+ * brightness for the segment's fractional phase, for when
+ * refresh_hz is set.
+ */
+struct kcylon_pattern {
+	const char *name;
+	void (*step)(struct kcylon_segment *seg, unsigned long *base, ktime_t now);
+	void (*smooth)(struct kcylon_segment *seg, struct kcylon_frame *base, ktime_t now);
+};
+
+/**
+ * @brief State of the keypad matrix: the IRQs of its columns,
+ * whether a scan is in progress, the debounced key states
+ * and the per key debounce counters
+ */
+static int matrix_irqs[KCYLON_MATRIX_MAX];
+static atomic_t matrix_scanning = ATOMIC_INIT(0);
+static bool matrix_stopping;
+static ktime_t matrix_edge;
+static DECLARE_BITMAP(matrix_down, KCYLON_MATRIX_MAX * KCYLON_MATRIX_MAX);
+static u8 matrix_count[KCYLON_MATRIX_MAX * KCYLON_MATRIX_MAX];
+static struct delayed_work matrix_work;
+
+/**
+ * @brief Woken when the engine makes room in a keyframe queue
+ */
+static DECLARE_WAIT_QUEUE_HEAD(kcylon_wait);
+
+/**
+ * @brief Occupancy of the last complete sweep as read by
+ * /dev/kcylon
+ */
+struct kcylon_sweep {
+	u32 seq;	/**< sweep number, 1 based */
+	u32 strip;
+	u64 occupancy;	/**< LEDs whose light the sense GPIO saw */
+};
+
+/**
+ * @brief Sense sampling state: the timer reading the sense
+ * GPIO, the LED the beam was on and the segment's sweep when
+ * it was armed, the sweep being built and the last one
+ * completed
+ */
+static struct hrtimer sense_timer;
+static int sense_led;
+static u32 sense_sweep;
+static u32 sense_building;
+static DECLARE_BITMAP(sense_bits, KCYLON_MAX_LEDS);
+static unsigned int sense_samples;
+static struct kcylon_sweep sense_last;
+static DEFINE_SPINLOCK(sense_lock);
+static DECLARE_WAIT_QUEUE_HEAD(sense_wait);
+
+/**
+ * @brief Keyframes written to /dev/kcylon, and reached by the
+ * engine
+ */
+static u64 keyframes_written;
+static u64 keyframes_reached;
+
+/**
+ * @brief debugfs directory holding the stats file
+ */
+static struct dentry *debug_dir;
+
+/**
+ * @brief Prototypes for the irq handler and its thread
+ *
+ * Used as callbacks for button presses
+ */
+static irqreturn_t kcylon_irq_handler(int irq, void *dev_id);
+static irqreturn_t kcylon_irq_thread(int irq, void *dev_id);
+
+/**
+ * @brief Sums a strip's per-CPU counters
+ *
+ * @param strip the strip to sum up
+ * @param total filled with the totals
+ */
+static void kcylon_stats_sum(struct kcylon_strip *strip, struct kcylon_stats *total)
+{
+	int cpu;
+	memset(total, 0, sizeof(*total));
+	for_each_possible_cpu(cpu) {
+		struct kcylon_stats *s = per_cpu_ptr(strip->stats, cpu);
+		total->wakeups += s->wakeups;
+		total->frames += s->frames;
+		total->frame_ns += s->frame_ns;
+		total->gpio_writes += s->gpio_writes;
+		total->gpio_ns += s->gpio_ns;
+		total->irqs += s->irqs;
+		total->irq_ns += s->irq_ns;
+		total->metric_samples += s->metric_samples;
+		total->metric_ns += s->metric_ns;
+		total->polls += s->polls;
+		total->poll_edges += s->poll_edges;
+		total->poll_ns += s->poll_ns;
+	}
+}
+
+/**
+ * @brief Scales the difference between two counter values to
+ * a per-second rate
+ */
+static u64 kcylon_rate(u64 now, u64 then, u64 window_ns)
+{
+	return div64_u64((now - then) * NSEC_PER_SEC, window_ns);
+}
+
+/**
+ * @brief Closes the rolling rate window once a second has passed
+ *
+ * Only the engine thread calls this, so the window needs no lock.
+ *
+ * @param strip the strip whose rate is updated
+ * @param now the current time
+ */
+static void kcylon_stats_roll(struct kcylon_strip *strip, ktime_t now)
+{
+	struct kcylon_stats total;
+	u64 window = ktime_to_ns(ktime_sub(now, strip->rate_stamp));
+	if (window < NSEC_PER_SEC)
+		return;
+	kcylon_stats_sum(strip, &total);
+	strip->rate.wakeups = kcylon_rate(total.wakeups, strip->rate_base.wakeups, window);
+	strip->rate.frames = kcylon_rate(total.frames, strip->rate_base.frames, window);
+	strip->rate.frame_ns = kcylon_rate(total.frame_ns, strip->rate_base.frame_ns, window);
+	strip->rate.gpio_writes = kcylon_rate(total.gpio_writes, strip->rate_base.gpio_writes, window);
+	strip->rate.gpio_ns = kcylon_rate(total.gpio_ns, strip->rate_base.gpio_ns, window);
+	strip->rate.irqs = kcylon_rate(total.irqs, strip->rate_base.irqs, window);
+	strip->rate.irq_ns = kcylon_rate(total.irq_ns, strip->rate_base.irq_ns, window);
+	strip->rate.metric_samples = kcylon_rate(total.metric_samples, strip->rate_base.metric_samples, window);
+	strip->rate.metric_ns = kcylon_rate(total.metric_ns, strip->rate_base.metric_ns, window);
+	strip->rate.polls = kcylon_rate(total.polls, strip->rate_base.polls, window);
+	strip->rate.poll_edges = kcylon_rate(total.poll_edges, strip->rate_base.poll_edges, window);
+	strip->rate.poll_ns = kcylon_rate(total.poll_ns, strip->rate_base.poll_ns, window);
+	strip->rate_base = total;
+	strip->rate_stamp = now;
+}
+
+/**
+ * @brief Writes a frame to a strip's GPIOs
+ *
+ * Only the chips with LEDs which differ from what is shown
+ * are written, each with a single batched write. Chips which
+ * light an LED go before chips which only put LEDs out, so a
+ * beam crossing from one chip to the next is briefly on both
+ * rather than briefly on neither.
+ *
+ * @param strip the strip to write to
+ * @param frame bitmap of the LEDs which should be lit
+ */
+static void kcylon_strip_write(struct kcylon_strip *strip, const unsigned long *frame)
+{
+	DECLARE_BITMAP(changed, KCYLON_MAX_LEDS);
+	DECLARE_BITMAP(lit, KCYLON_MAX_LEDS);
+	DECLARE_BITMAP(values, KCYLON_MAX_LEDS);
+	u64 start = ktime_get_ns();
+	unsigned int i, k, pass, writes = 0;
+	bitmap_xor(changed, frame, strip->shown, strip->num_outputs);
+	if (bitmap_empty(changed, strip->num_outputs))
+		return;
+	bitmap_and(lit, changed, frame, strip->num_outputs);
+	/* on-time is only touched for outputs which change */
+	for_each_set_bit(i, changed, strip->num_outputs) {
+		if (test_bit(i, frame))
+			strip->on_since[i] = start;
+		else
+			strip->on_ns[i] += start - strip->on_since[i];
+	}
+	strip->lit_ns += bitmap_weight(strip->shown, strip->num_outputs) * (start - strip->shown_since);
+	strip->shown_since = start;
+	for (pass = 0; pass < 2; pass++) {
+		for (i = 0; i < strip->num_banks; i++) {
+			struct kcylon_bank *bank = &strip->banks[i];
+			if (!bitmap_intersects(changed, bank->mask, strip->num_outputs) ||
+			    bitmap_intersects(lit, bank->mask, strip->num_outputs) != !pass)
+				continue;
+			for (k = 0; k < bank->count; k++)
+				__assign_bit(k, values, test_bit(bank->leds[k], frame));
+			if (bank->cansleep)
+				gpiod_set_array_value_cansleep(bank->count, bank->descs, NULL, values);
+			else
+				gpiod_set_array_value(bank->count, bank->descs, NULL, values);
+			writes++;
+		}
+	}
+	bitmap_copy(strip->shown, frame, strip->num_outputs);
+	this_cpu_add(strip->stats->gpio_writes, writes);
+	this_cpu_add(strip->stats->gpio_ns, ktime_get_ns() - start);
+}
+
+/**
+ * @brief Makes the engine draw a strip's next frame now
+ *
+ * Nothing is woken while the engine isn't running.
+ *
+ * @param strip the strip which changed
+ */
+static void kcylon_engine_wake(struct kcylon_strip *strip)
+{
+	struct task_struct *engine = READ_ONCE(task);
+	WRITE_ONCE(strip->redraw, true);
+	if (engine)
+		wake_up_process(engine);
+}
+
+/**
+ * @brief Pushes an overlay layer onto a strip
+ *
+ * Safe to call from interrupt context. A live layer with the
+ * same tag is replaced in place, keeping its stack position.
+ *
+ * @param strip the strip to overlay
+ * @param bits the LEDs the layer lights
+ * @param mask the LEDs the layer covers
+ * @param blend how the layer combines with the frame below
+ * @param tag the owner of the layer
+ * @param lifetime_ms how long the layer stays, 0 for ever
+ * @param blink_ms 0 for a steady layer, else its blink half period
+ * @return returns 0 on success, -ENOSPC if the stack is full
+ */
+static int kcylon_layer_push(struct kcylon_strip *strip, const unsigned long *bits,
+			     const unsigned long *mask, enum kcylon_blend blend, int tag,
+			     unsigned int lifetime_ms, unsigned int blink_ms)
+{
+	struct kcylon_layer *layer = NULL;
+	ktime_t now = ktime_get();
+	unsigned long flags;
+	unsigned int i;
+	int ret = 0;
+	spin_lock_irqsave(&strip->layer_lock, flags);
+	for (i = 0; i < strip->num_layers; i++)
+		if (strip->layers[i].tag == tag)
+			layer = &strip->layers[i];
+	if (!layer && strip->num_layers < KCYLON_MAX_LAYERS)
+		layer = &strip->layers[strip->num_layers++];
+	if (layer) {
+		bitmap_and(layer->bits, bits, mask, KCYLON_MAX_LEDS);
+		bitmap_copy(layer->mask, mask, KCYLON_MAX_LEDS);
+		layer->blend = blend;
+		layer->tag = tag;
+		layer->start = now;
+		layer->expires = lifetime_ms ? ktime_add_ms(now, lifetime_ms) : KTIME_MAX;
+		layer->blink_ms = blink_ms;
+	} else {
+		ret = -ENOSPC;
+	}
+	spin_unlock_irqrestore(&strip->layer_lock, flags);
+	/* the engine may be holding a frame, unless it pushed the layer */
+	if (!ret && current != task)
+		kcylon_engine_wake(strip);
+	return ret;
+}
+
+/**
+ * @brief Composes a strip's overlay layers onto a frame
+ *
+ * Layers are applied bottom first with whole-word bitmap
+ * operations on every plane, so a lit layer LED is at full
+ * brightness. Expired layers are dropped from the stack.
+ *
+ * @param strip the strip whose layers are applied
+ * @param frame the base frame, composed in place
+ * @param now the time the frame is for
+ */
+static void kcylon_compose(struct kcylon_strip *strip, struct kcylon_frame *frame, ktime_t now)
+{
+	DECLARE_BITMAP(tmp, KCYLON_MAX_LEDS);
+	unsigned long flags;
+	unsigned int i, k, live = 0;
+	spin_lock_irqsave(&strip->layer_lock, flags);
+	for (i = 0; i < strip->num_layers; i++) {
+		struct kcylon_layer *layer = &strip->layers[i];
+		if (ktime_after(now, layer->expires))
+			continue;
+		if (live != i)
+			strip->layers[live] = *layer;
+		layer = &strip->layers[live++];
+		if (layer->blink_ms &&
+		    div_u64(ktime_to_ms(ktime_sub(now, layer->start)), layer->blink_ms) & 1)
+			continue;
+		for (k = 0; k < KCYLON_BAM_BITS; k++) {
+			unsigned long *plane = frame->plane[k];
+			switch (layer->blend) {
+			case KCYLON_BLEND_OR:
+				bitmap_or(plane, plane, layer->bits, KCYLON_MAX_LEDS);
+				break;
+			case KCYLON_BLEND_XOR:
+				bitmap_xor(plane, plane, layer->bits, KCYLON_MAX_LEDS);
+				break;
+			case KCYLON_BLEND_REPLACE:
+				bitmap_andnot(tmp, plane, layer->mask, KCYLON_MAX_LEDS);
+				bitmap_or(plane, tmp, layer->bits, KCYLON_MAX_LEDS);
+				break;
+			}
+		}
+	}
+	strip->num_layers = live;
+	spin_unlock_irqrestore(&strip->layer_lock, flags);
+}
+
+/**
+ * @brief Works out when a strip's overlays next change what
+ * they show, by expiring or by blinking
+ *
+ * @param strip the strip whose layers are looked at
+ * @param now the time the frame is for
+ * @return returns the time of the next change, KTIME_MAX if none
+ */
+static ktime_t kcylon_layers_next(struct kcylon_strip *strip, ktime_t now)
+{
+	ktime_t next = KTIME_MAX;
+	unsigned long flags;
+	unsigned int i;
+	spin_lock_irqsave(&strip->layer_lock, flags);
+	for (i = 0; i < strip->num_layers; i++) {
+		struct kcylon_layer *layer = &strip->layers[i];
+		if (layer->expires != KTIME_MAX)
+			next = min(next, ktime_add_ns(layer->expires, 1));
+		if (layer->blink_ms) {
+			u64 edges = div_u64(ktime_to_ms(ktime_sub(now, layer->start)), layer->blink_ms) + 1;
+			next = min(next, ktime_add_ms(layer->start, edges * layer->blink_ms));
+		}
+	}
+	spin_unlock_irqrestore(&strip->layer_lock, flags);
+	return next;
+}
+
+/**
+ * @brief Overlays a bar showing a speed level on a segment
+ *
+ * Slower levels grow from the segment's first LED, faster
+ * ones from its last.
+ *
+ * @param strip the strip to show the level on
+ * @param id the segment whose level it is
+ * @param level the button level
+ */
+static void kcylon_show_level(struct kcylon_strip *strip, unsigned int id, int level)
+{
+	struct kcylon_segment *seg = &strip->segments[id];
+	DECLARE_BITMAP(bar, KCYLON_MAX_LEDS);
+	DECLARE_BITMAP(mask, KCYLON_MAX_LEDS);
+	unsigned int n = min_t(unsigned int, abs(level), seg->num_leds);
+	bitmap_zero(bar, KCYLON_MAX_LEDS);
+	bitmap_zero(mask, KCYLON_MAX_LEDS);
+	bitmap_set(mask, seg->first, seg->num_leds);
+	if (level > 0)
+		bitmap_set(bar, seg->first, n);
+	else
+		bitmap_set(bar, seg->first + seg->num_leds - n, n);
+	kcylon_layer_push(strip, bar, mask, KCYLON_BLEND_REPLACE, KCYLON_LAYER_LEVEL + id,
+			  level_bar_ms, 0);
+}
+
+/**
+ * @brief Expands an RGB strip's frame of palette indices into
+ * the bit-planes of its outputs
+ *
+ * The LEDs showing each palette entry are picked out of the
+ * index planes with a few word operations, then ORed into
+ * the planes of every channel bit the entry's colour has set.
+ * The cost depends on the palette size, not on the number of
+ * LEDs, so it is about that of three monochrome strips.
+ *
+ * @param strip the RGB strip
+ * @param frame a frame of indices, replaced by the outputs' planes
+ */
+static void kcylon_rgb_expand(struct kcylon_strip *strip, struct kcylon_frame *frame)
+{
+	struct kcylon_frame out;
+	DECLARE_BITMAP(sel, KCYLON_MAX_LEDS);
+	DECLARE_BITMAP(tmp, KCYLON_MAX_LEDS);
+	unsigned int n = strip->num_leds, p, k, c;
+	memset(&out, 0, sizeof(out));
+	for (p = 1; p < ARRAY_SIZE(strip->palette); p++) {
+		if (!strip->palette[p])
+			continue;
+		bitmap_fill(sel, n);
+		for (k = 0; k < KCYLON_BAM_BITS; k++) {
+			if (p & BIT(k))
+				bitmap_and(sel, sel, frame->plane[k], n);
+			else
+				bitmap_andnot(sel, sel, frame->plane[k], n);
+		}
+		if (bitmap_empty(sel, n))
+			continue;
+		for (c = 0; c < 3; c++) {
+			unsigned int colour = (strip->palette[p] >> (4 * (2 - c))) & 0xf;
+			if (!colour)
+				continue;
+			bitmap_shift_left(tmp, sel, c * n, KCYLON_MAX_LEDS);
+			for (k = 0; k < KCYLON_BAM_BITS; k++)
+				if (colour & BIT(k))
+					bitmap_or(out.plane[k], out.plane[k], tmp, KCYLON_MAX_LEDS);
+		}
+	}
+	*frame = out;
+}
+
+/**
+ * @brief Composes a strip's base frame and overlays into the
+ * frame its outputs show
+ *
+ * Called with the strip's out_lock held.
+ *
+ * @param strip the strip to compose
+ * @param now the time the frame is for
+ */
+static void kcylon_strip_compose(struct kcylon_strip *strip, ktime_t now)
+{
+	strip->out = strip->base;
+	kcylon_compose(strip, &strip->out, now);
+	if (strip->rgb)
+		kcylon_rgb_expand(strip, &strip->out);
+}
+
+/**
+ * @brief Flashes a strip straight away to acknowledge a press
+ *
+ * The frame on show is inverted for ack_ms and then recomposed
+ * from the last base frame with the overlays live by then. The
+ * press itself only wakes the engine, which shows its level
+ * bar when it takes the press at its next frame, usually while
+ * the flash is on. Brightness comes back at the engine's next
+ * refresh. The engine's deadlines are left alone; if it
+ * writes a frame meanwhile the flash is just cut short. Flashes
+ * closer than ack_interval_ms to the previous one are skipped.
+ *
+ * @param strip the strip to flash
+ * @param edge when the press was seen by the hard IRQ handler
+ */
+static void kcylon_strip_ack(struct kcylon_strip *strip, ktime_t edge)
+{
+	DECLARE_BITMAP(frame, KCYLON_MAX_LEDS);
+	ktime_t now = ktime_get();
+	u64 latency;
+	mutex_lock(&strip->out_lock);
+	if (ktime_before(now, ktime_add_ms(strip->ack_last, ack_interval_ms))) {
+		mutex_unlock(&strip->out_lock);
+		return;
+	}
+	strip->ack_last = now;
+	bitmap_complement(frame, strip->shown, KCYLON_MAX_LEDS);
+	kcylon_strip_write(strip, frame);
+	latency = ktime_to_ns(ktime_sub(ktime_get(), edge));
+	strip->acks++;
+	strip->ack_latency_ns += latency;
+	strip->ack_latency_max_ns = max(strip->ack_latency_max_ns, latency);
+	mutex_unlock(&strip->out_lock);
+
+	msleep(ack_ms);
+
+	mutex_lock(&strip->out_lock);
+	kcylon_strip_compose(strip, ktime_get());
+	kcylon_strip_write(strip, strip->out.plane[KCYLON_BAM_BITS - 1]);
+	mutex_unlock(&strip->out_lock);
+}
+
+/**
+ * @brief Records an input event in the trace ring
+ *
+ * @param source where the event came from
+ * @param strip the strip it was for
+ * @param segment the segment it was for
+ * @param edge when it happened
+ * @param cmd what it asked for
+ * @param level the button level after it
+ * @param direction the button direction after it
+ */
+static void kcylon_trace_record(enum kcylon_source source, unsigned int strip, unsigned int segment,
+				ktime_t edge, enum kcylon_cmd cmd, int level, int direction)
+{
+	u32 seq = atomic_inc_return(&trace_head);
+	struct kcylon_trace_entry *e = &trace_ring[(seq - 1) & (KCYLON_TRACE_LEN - 1)];
+	WRITE_ONCE(e->seq, 0);
+	smp_wmb();
+	e->time_ns = ktime_to_ns(edge);
+	e->source = source;
+	e->strip = strip;
+	e->segment = segment;
+	e->level = level;
+	e->direction = direction;
+	e->cmd = cmd;
+	smp_wmb();
+	WRITE_ONCE(e->seq, seq);
+}
+
+/**
+ * @brief Moves a segment's position one LED along, turning
+ * round at either end
+ *
+ * @param seg the segment to move
+ */
+static void kcylon_bounce(struct kcylon_segment *seg)
+{
+	int last = seg->num_leds - 1;
+	if (seg->rising)
+		seg->current_led++;
+	else
+		seg->current_led--;
+	if (seg->current_led > last) {
+		seg->current_led = last;
+		seg->rising = 0;
+	}
+	if (seg->current_led < 0) {
+		seg->current_led = 0;
+		seg->rising = 1;
+	}
+}
+
+/**
+ * @brief A single LED sweeping back and forth
+ */
+static void kcylon_pattern_cylon(struct kcylon_segment *seg, unsigned long *base, ktime_t now)
+{
+	__set_bit(seg->first + seg->current_led, base);
+	kcylon_bounce(seg);
+}
+
+/**
+ * @brief A single LED running off one end and back in at
+ * the other
+ */
+static void kcylon_pattern_chase(struct kcylon_segment *seg, unsigned long *base, ktime_t now)
+{
+	__set_bit(seg->first + seg->current_led, base);
+	seg->current_led = (seg->current_led + 1) % seg->num_leds;
+}
+
+/**
+ * @brief A bar filling up from the first LED and emptying again
+ */
+static void kcylon_pattern_fill(struct kcylon_segment *seg, unsigned long *base, ktime_t now)
+{
+	bitmap_set(base, seg->first, seg->current_led + 1);
+	kcylon_bounce(seg);
+}
+
+/**
+ * @brief Sets the brightness of one LED of a frame
+ *
+ * @param frame the frame to draw in
+ * @param led the LED
+ * @param level its brightness, 0 to KCYLON_BAM_SLOTS
+ */
+static void kcylon_frame_set(struct kcylon_frame *frame, unsigned int led, unsigned int level)
+{
+	unsigned int k;
+	for (k = 0; k < KCYLON_BAM_BITS; k++)
+		__assign_bit(led, frame->plane[k], level & BIT(k));
+}
+
+/**
+ * @brief Draws a beam at a fractional position, sharing its
+ * brightness between the two LEDs it lies between
+ *
+ * @param frame the frame to draw in
+ * @param a the LED the position counts from
+ * @param b the next LED along
+ * @param frac how far the beam is from a to b, in 1/65536
+ */
+static void kcylon_frame_beam(struct kcylon_frame *frame, unsigned int a, unsigned int b, u32 frac)
+{
+	unsigned int level = (frac * KCYLON_BAM_SLOTS + 0x8000) >> 16;
+	kcylon_frame_set(frame, a, KCYLON_BAM_SLOTS - level);
+	if (level)
+		kcylon_frame_set(frame, b, level);
+}
+
+/**
+ * @brief Folds a phase onto a path which goes up to last and
+ * back, as the cylon's and the fill's do
+ *
+ * @param seg the segment whose phase is folded
+ * @param last where the path turns round
+ * @return returns the position along the path in 1/65536 LEDs
+ */
+static u32 kcylon_phase_fold(struct kcylon_segment *seg, unsigned int last)
+{
+	u32 length = 2 * last << 16;
+	u32 pos;
+	/* a one LED path has nowhere to go */
+	if (!last)
+		return 0;
+	pos = seg->phase % length;
+	return pos <= last << 16 ? pos : length - pos;
+}
+
+static void kcylon_smooth_cylon(struct kcylon_segment *seg, struct kcylon_frame *base, ktime_t now)
+{
+	u32 pos = kcylon_phase_fold(seg, seg->num_leds - 1);
+	unsigned int led = pos >> 16;
+	kcylon_frame_beam(base, seg->first + led, seg->first + min(led + 1, seg->num_leds - 1),
+			  pos & 0xffff);
+}
+
+static void kcylon_smooth_chase(struct kcylon_segment *seg, struct kcylon_frame *base, ktime_t now)
+{
+	u32 pos = seg->phase % (seg->num_leds << 16);
+	unsigned int led = pos >> 16;
+	kcylon_frame_beam(base, seg->first + led, seg->first + (led + 1) % seg->num_leds, pos & 0xffff);
+}
+
+static void kcylon_smooth_fill(struct kcylon_segment *seg, struct kcylon_frame *base, ktime_t now)
+{
+	u32 pos = kcylon_phase_fold(seg, seg->num_leds);
+	unsigned int leds = pos >> 16, k;
+	for (k = 0; k < KCYLON_BAM_BITS; k++)
+		bitmap_set(base->plane[k], seg->first, leds);
+	if (leds < seg->num_leds)
+		kcylon_frame_set(base, seg->first + leds, ((pos & 0xffff) * KCYLON_BAM_SLOTS + 0x8000) >> 16);
+}
+
+/**
+ * @brief Works out a segment's keyframe intensities for a time
+ *
+ * Keyframes whose time has passed are dropped from the queue.
+ * Between two keyframes each LED moves linearly from one to
+ * the other, in 16 bit fixed point. Past the last one, the
+ * segment holds it.
+ *
+ * @param seg the segment whose keyframes are interpolated
+ * @param now the time to interpolate for
+ * @param out filled with one intensity, 0 to 255, per LED
+ */
+static void kcylon_keyframes_at(struct kcylon_segment *seg, ktime_t now, u8 *out)
+{
+	struct kcylon_keyframes *kf = &seg->kf;
+	unsigned int i;
+	u32 frac;
+	u64 span;
+	while (kf->count) {
+		ktime_t at = ktime_add_ms(kf->from_time, kf->queue[kf->head].delay_ms);
+		if (ktime_before(now, at))
+			break;
+		memcpy(kf->from, kf->queue[kf->head].intensity, seg->num_leds);
+		kf->from_time = at;
+		kf->head = (kf->head + 1) % KCYLON_MAX_KEYFRAMES;
+		kf->count--;
+		keyframes_reached++;
+		wake_up_interruptible(&kcylon_wait);
+	}
+	if (!kf->count) {
+		memcpy(out, kf->from, seg->num_leds);
+		return;
+	}
+	span = (u64)kf->queue[kf->head].delay_ms * NSEC_PER_MSEC;
+	frac = 0;
+	if (ktime_after(now, kf->from_time))
+		frac = div64_u64(ktime_to_ns(ktime_sub(now, kf->from_time)) << 16, span);
+	for (i = 0; i < seg->num_leds; i++) {
+		int a = kf->from[i], b = kf->queue[kf->head].intensity[i];
+		out[i] = a + (((b - a) * (s32)frac) >> 16);
+	}
+}
+
+/**
+ * @brief When a keyframes segment's frame next changes
+ *
+ * @param seg the segment, whose frame has just been drawn
+ * @param due when its next frame would otherwise be due
+ * @return returns the earlier of due and its next keyframe, or
+ * KTIME_MAX if it holds its last keyframe until one is written
+ */
+static ktime_t kcylon_keyframes_next(struct kcylon_segment *seg, ktime_t due)
+{
+	struct kcylon_keyframes *kf = &seg->kf;
+	if (!kf->count)
+		return KTIME_MAX;
+	return min(due, ktime_add_ms(kf->from_time, kf->queue[kf->head].delay_ms));
+}
+
+/**
+ * @brief Intensities from keyframes written by userspace,
+ * lit at half intensity and above
+ */
+static void kcylon_pattern_keyframes(struct kcylon_segment *seg, unsigned long *base, ktime_t now)
+{
+	u8 intensity[KCYLON_MAX_LEDS];
+	unsigned int i;
+	kcylon_keyframes_at(seg, now, intensity);
+	for (i = 0; i < seg->num_leds; i++)
+		if (intensity[i] >= 128)
+			__set_bit(seg->first + i, base);
+}
+
+static void kcylon_smooth_keyframes(struct kcylon_segment *seg, struct kcylon_frame *base, ktime_t now)
+{
+	u8 intensity[KCYLON_MAX_LEDS];
+	unsigned int i;
+	kcylon_keyframes_at(seg, now, intensity);
+	for (i = 0; i < seg->num_leds; i++)
+		kcylon_frame_set(base, seg->first + i, (intensity[i] * KCYLON_BAM_SLOTS + 127) / 255);
+}
+
+/**
+ * @brief Index of the keyframes pattern in patterns[]. The
+ * patterns before it are the ones pattern commands cycle
+ * through, since keyframes are only shown once written.
+ */
+#define KCYLON_PATTERN_KEYFRAMES 3
+#define KCYLON_PATTERN_CYCLE KCYLON_PATTERN_KEYFRAMES
+
+static const struct kcylon_pattern patterns[] = {
+	{ "cylon", kcylon_pattern_cylon, kcylon_smooth_cylon },
+	{ "chase", kcylon_pattern_chase, kcylon_smooth_chase },
+	{ "fill", kcylon_pattern_fill, kcylon_smooth_fill },
+	[KCYLON_PATTERN_KEYFRAMES] = { "keyframes", kcylon_pattern_keyframes, kcylon_smooth_keyframes },
+};
+
+/**
+ * @brief Packs a segment's command word
+ *
+ * The word holds the segment's level and the direction the
+ * next press takes it in, which commands change straight
+ * away, then the pattern changes and the number of commands
+ * which the engine hasn't taken yet. Any number of commands
+ * fold into one word, which the engine takes once per frame.
+ *
+ * @param level the level after every command so far
+ * @param direction -1 or 1
+ * @param steps pattern changes not yet taken, kept non-zero once
+ * there are any
+ * @param count commands not yet taken
+ */
+static s64 kcylon_cmds_pack(int level, int direction, unsigned int steps, unsigned int count)
+{
+	if (steps)
+		steps = (steps - 1) % KCYLON_PATTERN_CYCLE + 1;
+	return (u8)level | (u64)(u8)direction << 8 | (u64)steps << 16 | (u64)min(count, 0xffffU) << 32;
+}
+
+#define KCYLON_CMDS_LEVEL(w) ((s8)(w))
+#define KCYLON_CMDS_DIRECTION(w) ((s8)((w) >> 8))
+#define KCYLON_CMDS_STEPS(w) (((w) >> 16) & 0xff)
+#define KCYLON_CMDS_COUNT(w) (((w) >> 32) & 0xffff)
+
+/**
+ * @brief Applies an input event to a segment
+ *  Folds the command into the segment's command
+ *  word without taking any lock, and records the
+ *  event. The engine applies it, and shows the
+ *  level, at its next frame.
+ *
+ * @param id the strip to control
+ * @param segment the segment of the strip to control
+ * @param cmd what to do
+ * @param source where the event came from
+ * @param edge when the event happened
+ * @param entry the state recorded for it if replaying, or NULL
+ * @return returns the segment's new level
+ */
+static int kcylon_strip_command(unsigned int id, unsigned int segment, enum kcylon_cmd cmd,
+				enum kcylon_source source, ktime_t edge,
+				const struct kcylon_trace_entry *entry)
+{
+	struct kcylon_strip *strip = &strips[id];
+	struct kcylon_segment *seg = &strip->segments[segment];
+	s64 old = atomic64_read(&seg->cmds), new;
+	int level, direction;
+	unsigned int steps;
+	/* the first command of a batch times it, the engine clears it */
+	atomic64_cmpxchg(&seg->cmd_edge, 0, ktime_to_ns(edge));
+	do {
+		level = KCYLON_CMDS_LEVEL(old);
+		direction = KCYLON_CMDS_DIRECTION(old);
+		steps = KCYLON_CMDS_STEPS(old);
+		switch (cmd) {
+		case KCYLON_CMD_PRESS:
+			level += direction;
+			if (level == 10 || level == -10)
+				direction *= -1;
+			break;
+		case KCYLON_CMD_FASTER:
+			level = max(level - 1, -9);
+			break;
+		case KCYLON_CMD_SLOWER:
+			level = min(level + 1, 9);
+			break;
+		case KCYLON_CMD_PATTERN:
+			steps++;
+			break;
+		default:
+			break;
+		}
+		new = kcylon_cmds_pack(level, direction, steps, KCYLON_CMDS_COUNT(old) + 1);
+	} while (!atomic64_try_cmpxchg(&seg->cmds, &old, new));
+	/* the first command since the last frame wakes the engine */
+	if (!KCYLON_CMDS_COUNT(old))
+		kcylon_engine_wake(strip);
+	kcylon_trace_record(source, id, segment, edge, cmd, level, direction);
+	if (entry && (entry->level != level || entry->direction != direction))
+		replay_divergences++;
+	return level;
+}
+
+/**
+ * @brief Takes the commands folded into a segment's command
+ * word since the last frame and applies them
+ *
+ * Called by the engine with the strip's out_lock held.
+ *
+ * @param strip the strip the segment is in
+ * @param id the segment
+ */
+static void kcylon_segment_take(struct kcylon_strip *strip, unsigned int id)
+{
+	struct kcylon_segment *seg = &strip->segments[id];
+	s64 old = atomic64_read(&seg->cmds);
+	unsigned int steps;
+	u64 edge;
+	if (!KCYLON_CMDS_COUNT(old))
+		return;
+	/* keep the level and direction, take the rest */
+	while (!atomic64_try_cmpxchg(&seg->cmds, &old, old & 0xffff))
+		;
+	edge = atomic64_xchg(&seg->cmd_edge, 0);
+	if (edge && (!strip->cmd_edge || edge < strip->cmd_edge))
+		strip->cmd_edge = edge;
+	WRITE_ONCE(seg->level, KCYLON_CMDS_LEVEL(old));
+	steps = KCYLON_CMDS_STEPS(old);
+	if (steps) {
+		if (seg->pattern == KCYLON_PATTERN_KEYFRAMES) {
+			/* leaving keyframes drops the rest, so writers waiting for room go on */
+			seg->pattern = (steps - 1) % KCYLON_PATTERN_CYCLE;
+			seg->kf.count = 0;
+			wake_up_interruptible(&kcylon_wait);
+		} else {
+			seg->pattern = (seg->pattern + steps) % KCYLON_PATTERN_CYCLE;
+		}
+		seg->current_led = 0;
+		seg->rising = 1;
+		seg->phase = 0;
+	}
+	strip->cmds_taken += KCYLON_CMDS_COUNT(old);
+	strip->cmds_frames++;
+	kcylon_show_level(strip, id, seg->level);
+}
+
+/**
+ * @brief How long a segment waits between frames at its
+ * current level, in milliseconds
+ */
+static unsigned int kcylon_segment_period_ms(struct kcylon_segment *seg)
+{
+	int level = READ_ONCE(seg->level);
+	/* a metric segment runs from level 9 when idle to -9 at full load */
+	if (seg->speed != KCYLON_SPEED_LEVEL)
+		level = 9 - (int)((seg->metric_load * 18 + 32768) >> 16);
+	return speed_table[clamp(level, -10, 10) + 10];
+}
+
+/**
+ * @brief Fills the speed table from sleep_time: level n is n
+ * times slower than level 0 and level -n n times faster
+ */
+static void kcylon_speed_table_fill(void)
+{
+	int level;
+	for (level = -10; level <= 10; level++) {
+		if (level > 0)
+			speed_table[level + 10] = sleep_time * level;
+		else if (level < 0)
+			speed_table[level + 10] = max(sleep_time / (-1 * level), 1U);
+		else
+			speed_table[level + 10] = sleep_time;
+	}
+}
+
+/**
+ * @brief A CPU's idle or iowait time in ns
+ *
+ * With NO_HZ the cpustat idle counters aren't kept current
+ * while a CPU sleeps, so the tick code's own count is read
+ * instead where there is one, as /proc/stat does.
+ *
+ * @param kcs the CPU's fetched counters
+ * @param cpu the CPU
+ * @param iowait whether to read iowait rather than idle time
+ */
+static u64 kcylon_cpu_idle_ns(const struct kernel_cpustat *kcs, int cpu, bool iowait)
+{
+	u64 us = -1ULL;
+	if (cpu_online(cpu))
+		us = iowait ? get_cpu_iowait_time_us(cpu, NULL) : get_cpu_idle_time_us(cpu, NULL);
+	if (us == -1ULL)
+		return kcs->cpustat[iowait ? CPUTIME_IOWAIT : CPUTIME_IDLE];
+	return us * NSEC_PER_USEC;
+}
+
+/**
+ * @brief Samples the system metric a segment follows and
+ * folds it into its smoothed load
+ *
+ * Only cumulative counters the kernel keeps anyway are read,
+ * one per online CPU, and the load is the change since the
+ * last sweep. The first sample only sets the baseline.
+ *
+ * @param strip the strip the segment is in, charged the cost
+ * @param seg the segment to sample for
+ * @param now the time the frame is for
+ */
+static void kcylon_metric_sample(struct kcylon_strip *strip, struct kcylon_segment *seg, ktime_t now)
+{
+	u64 start = ktime_get_ns();
+	u64 busy = 0, total = 0, window, full;
+	s32 sample;
+	int cpu;
+	for_each_online_cpu(cpu) {
+		switch (seg->speed) {
+		case KCYLON_SPEED_CPU: {
+			struct kernel_cpustat kcs;
+			u64 *t = kcs.cpustat, cpu_busy;
+			kcpustat_cpu_fetch(&kcs, cpu);
+			cpu_busy = t[CPUTIME_USER] + t[CPUTIME_NICE] + t[CPUTIME_SYSTEM] +
+				   t[CPUTIME_IRQ] + t[CPUTIME_SOFTIRQ] + t[CPUTIME_STEAL];
+			busy += cpu_busy;
+			total += cpu_busy + kcylon_cpu_idle_ns(&kcs, cpu, false) + kcylon_cpu_idle_ns(&kcs, cpu, true);
+			break;
+		}
+		case KCYLON_SPEED_BLOCK:
+			busy += kstat_softirqs_cpu(BLOCK_SOFTIRQ, cpu);
+			break;
+		case KCYLON_SPEED_IRQ:
+			busy += kstat_cpu_irqs_sum(cpu);
+			break;
+		}
+	}
+	if (seg->metric_stamp) {
+		if (seg->speed == KCYLON_SPEED_CPU) {
+			window = total - seg->metric_total;
+			full = window;
+		} else {
+			window = ktime_to_ns(ktime_sub(now, seg->metric_stamp));
+			full = div_u64((u64)(seg->speed == KCYLON_SPEED_BLOCK ? speed_block_full : speed_irq_full) *
+				       window, NSEC_PER_SEC);
+		}
+		if (full) {
+			sample = min_t(u64, div64_u64((busy - seg->metric_busy) << 16, full), 65536);
+			seg->metric_load += (sample - (s32)seg->metric_load) >> min(speed_smoothing, 16U);
+		}
+	}
+	seg->metric_busy = busy;
+	seg->metric_total = total;
+	seg->metric_stamp = now;
+	this_cpu_inc(strip->stats->metric_samples);
+	this_cpu_add(strip->stats->metric_ns, ktime_get_ns() - start);
+}
+
+/**
+ * @brief Works out how long a smooth segment's frame holds
+ *
+ * The built-in patterns light LEDs in brightness steps of
+ * 1/KCYLON_BAM_SLOTS of the way from one LED to the next, so
+ * their frames only change when the phase crosses a step.
+ *
+ * @param seg the segment, whose frame has just been drawn
+ * @param period the segment's period in ns
+ * @return returns the time in ns until its phase crosses the next step
+ */
+static u64 kcylon_smooth_hold(struct kcylon_segment *seg, u64 period)
+{
+	u64 step = ((u64)seg->phase * KCYLON_BAM_SLOTS + 0x8000) >> 16;
+	u64 next = DIV_ROUND_UP_ULL(((step + 1) << 16) - 0x8000, KCYLON_BAM_SLOTS);
+	return ((next - seg->phase) * period + 0xffff) >> 16;
+}
+
+/**
+ * @brief Renders the segments of a strip which are due into
+ * its base frame and moves their patterns on
+ *
+ * Segments which aren't due keep their part of the base frame.
+ * A segment is next due when its frame next changes: with
+ * refresh_hz set, at the first refresh after its phase crosses
+ * a brightness step, moving one LED per period of its level.
+ * Without, a period later, or two at a held end of a sweep.
+ *
+ * @param strip the strip to render
+ * @param now the time the frame is for
+ * @return returns when the next segment is due
+ */
+static ktime_t kcylon_strip_render(struct kcylon_strip *strip, ktime_t now)
+{
+	DECLARE_BITMAP(bits, KCYLON_MAX_LEDS);
+	ktime_t next = KTIME_MAX;
+	unsigned int i, k;
+	for (i = 0; i < strip->num_segments; i++) {
+		struct kcylon_segment *seg = &strip->segments[i];
+		u64 period;
+		kcylon_segment_take(strip, i);
+		/* one which held its last keyframe is due once it leaves them */
+		if (seg->deadline == KTIME_MAX && seg->pattern != KCYLON_PATTERN_KEYFRAMES)
+			seg->deadline = now;
+		period = (u64)kcylon_segment_period_ms(seg) * NSEC_PER_MSEC;
+		if (ktime_before(now, seg->deadline)) {
+			next = min(next, seg->deadline);
+			continue;
+		}
+		for (k = 0; k < KCYLON_BAM_BITS; k++)
+			bitmap_clear(strip->base.plane[k], seg->first, seg->num_leds);
+		if (refresh_hz) {
+			u64 frame = NSEC_PER_SEC / refresh_hz, hold = frame;
+			/* wrap where every pattern's path starts over */
+			u32 wrap = (2 * seg->num_leds * max(seg->num_leds - 1, 1U)) << 16;
+			/* a sweep is one trip there and back */
+			u32 sweep = (2 * max(seg->num_leds - 1, 1U)) << 16;
+			u32 swept = seg->phase / sweep;
+			/* catch up on however late the frame is */
+			div_u64_rem(seg->phase + div64_u64(ktime_to_ns(ktime_sub(now, seg->deadline)) << 16,
+							   period), wrap, &seg->phase);
+			patterns[seg->pattern].smooth(seg, &strip->base, now);
+			if (seg->pattern != KCYLON_PATTERN_KEYFRAMES)
+				hold = max(div64_u64(kcylon_smooth_hold(seg, period) + frame - 1, frame), 1ULL) * frame;
+			div_u64_rem(seg->phase + div64_u64(hold << 16, period), wrap, &seg->phase);
+			seg->deadline = ktime_add_ns(now, hold);
+			if (seg->phase / sweep != swept) {
+				seg->sweeps++;
+				if (seg->speed != KCYLON_SPEED_LEVEL)
+					kcylon_metric_sample(strip, seg, now);
+			}
+		} else {
+			int drawn = seg->current_led;
+			unsigned int skip;
+			bitmap_zero(bits, KCYLON_MAX_LEDS);
+			patterns[seg->pattern].step(seg, bits, now);
+			/* every pattern is back at its first LED once a sweep */
+			if (seg->current_led == 0 && seg->rising) {
+				seg->sweeps++;
+				if (seg->speed != KCYLON_SPEED_LEVEL)
+					kcylon_metric_sample(strip, seg, now);
+			}
+			for (k = 0; k < KCYLON_BAM_BITS; k++)
+				bitmap_or(strip->base.plane[k], strip->base.plane[k], bits, KCYLON_MAX_LEDS);
+			/*
+			 * Frames are due on a fixed sequence of absolute deadlines,
+			 * so time spent elsewhere (acks, preemption) doesn't
+			 * accumulate as drift. After an overrun the sequence
+			 * restarts from now rather than bursting to catch up.
+			 */
+			seg->deadline = ktime_add_ns(seg->deadline, period);
+			if (ktime_before(seg->deadline, now))
+				seg->deadline = ktime_add_ns(now, period);
+			/*
+			 * The built-in patterns draw from current_led alone, so
+			 * a step which leaves it where it was, at a held end of
+			 * a sweep, would draw the same frame again: skip it.
+			 */
+			for (skip = 0; seg->pattern != KCYLON_PATTERN_KEYFRAMES && seg->current_led == drawn &&
+			     skip < seg->num_leds; skip++) {
+				patterns[seg->pattern].step(seg, bits, now);
+				seg->deadline = ktime_add_ns(seg->deadline, period);
+			}
+		}
+		if (seg->pattern == KCYLON_PATTERN_KEYFRAMES)
+			seg->deadline = kcylon_keyframes_next(seg, seg->deadline);
+		next = min(next, seg->deadline);
+	}
+	return next;
+}
+
+/**
+ * @brief Reads the sense GPIO for the LED the beam is on
+ *
+ * A sweep ends when the followed segment starts its next trip
+ * there and back, and is then published to readers of
+ * /dev/kcylon with a single wakeup.
+ */
+static enum hrtimer_restart kcylon_sense_sample(struct hrtimer *timer)
+{
+	unsigned long flags;
+	spin_lock_irqsave(&sense_lock, flags);
+	if (sense_sweep != sense_building) {
+		if (sense_samples) {
+			sense_last.seq++;
+			sense_last.strip = sense_strip;
+			bitmap_to_arr64(&sense_last.occupancy, sense_bits, KCYLON_MAX_LEDS);
+			wake_up_interruptible(&sense_wait);
+		}
+		bitmap_zero(sense_bits, KCYLON_MAX_LEDS);
+		sense_samples = 0;
+		sense_building = sense_sweep;
+	}
+	if (gpio_get_value(sense_pin))
+		__set_bit(sense_led, sense_bits);
+	sense_samples++;
+	spin_unlock_irqrestore(&sense_lock, flags);
+	return HRTIMER_NORESTART;
+}
+
+/**
+ * @brief Arms the sense sample for a frame just written
+ *
+ * The beam is taken to be on the last lit LED of the followed
+ * segment in the frame before overlays, which is the leading
+ * edge for the fill.
+ *
+ * @param strip the strip the frame was written to
+ */
+static void kcylon_sense_arm(struct kcylon_strip *strip)
+{
+	struct kcylon_segment *seg = &strip->segments[sense_segment];
+	unsigned int end = seg->first + seg->num_leds;
+	unsigned int led = find_last_bit(strip->base.plane[KCYLON_BAM_BITS - 1], end);
+	if (led < seg->first || led >= end)
+		return;
+	sense_led = led;
+	sense_sweep = seg->sweeps;
+	hrtimer_start(&sense_timer, us_to_ktime(sense_offset_us), HRTIMER_MODE_REL_PINNED);
+}
+
+/**
+ * @brief Shows the next plane of a strip's frame, or renders
+ * and shows its next frame
+ *
+ * A frame is only rendered when it next changes visibly, as
+ * its segments and overlays work out, or when a layer has
+ * been pushed. A frame whose planes are all the same is
+ * written once and held until then. Otherwise its planes are
+ * written most significant first, each held for its share of
+ * a refresh period, and shown again each refresh until the
+ * frame changes. A strip with brightness costs
+ * KCYLON_BAM_BITS writes per refresh rather than one per
+ * brightness step.
+ *
+ * @param strip the strip to step
+ * @param now the time the frame is for
+ * @return returns true if a new frame was rendered
+ */
+static bool kcylon_strip_step(struct kcylon_strip *strip, ktime_t now)
+{
+	bool rendered = false;
+	unsigned int k;
+	int plane;
+	mutex_lock(&strip->out_lock);
+	if (READ_ONCE(strip->redraw)) {
+		WRITE_ONCE(strip->redraw, false);
+		strip->next_change = now;
+		strip->bam_plane = -1;
+	}
+	if (strip->bam_plane < 0) {
+		if (!ktime_before(now, strip->next_change)) {
+			strip->next_change = kcylon_strip_render(strip, now);
+			kcylon_strip_compose(strip, now);
+			strip->next_change = min(strip->next_change, kcylon_layers_next(strip, now));
+			rendered = true;
+		}
+		strip->bam_plane = KCYLON_BAM_BITS - 1;
+		strip->bam_end = strip->next_change;
+		for (k = 0; k < KCYLON_BAM_BITS - 1; k++)
+			if (!bitmap_equal(strip->out.plane[k], strip->out.plane[k + 1], strip->num_outputs))
+				break;
+		if (k == KCYLON_BAM_BITS - 1 || !refresh_hz) {
+			/* without BAM, show the most significant plane */
+			bitmap_copy(strip->out.plane[0], strip->out.plane[KCYLON_BAM_BITS - 1],
+				    KCYLON_MAX_LEDS);
+			strip->bam_plane = 0;
+		} else {
+			strip->bam_end = min(strip->bam_end, ktime_add_ns(now, NSEC_PER_SEC / refresh_hz));
+		}
+		strip->bam_deadline = now;
+	}
+	plane = strip->bam_plane--;
+	kcylon_strip_write(strip, strip->out.plane[plane]);
+	if (rendered && strip->cmd_edge) {
+		/* the frame applying the commands taken is out */
+		u64 latency = ktime_get_ns() - strip->cmd_edge;
+		bool colocated = READ_ONCE(engine_cpu) >= 0;
+		strip->cmd_latency_last_ns = latency;
+		strip->cmd_latency_ns[colocated] += latency;
+		strip->cmd_latency_max_ns[colocated] = max(strip->cmd_latency_max_ns[colocated], latency);
+		strip->cmd_latencies[colocated]++;
+		strip->cmd_edge = 0;
+	}
+	if (rendered && sense_pin >= 0 && strip == &strips[sense_strip])
+		kcylon_sense_arm(strip);
+	if (plane) {
+		u64 left = ktime_to_ns(ktime_sub(strip->bam_end, strip->bam_deadline));
+		strip->bam_deadline = ktime_add_ns(strip->bam_deadline,
+						   div_u64(left << plane, (2 << plane) - 1));
+		strip->deadline = strip->bam_deadline;
+	} else {
+		strip->deadline = strip->bam_end;
+	}
+	mutex_unlock(&strip->out_lock);
+	return rendered;
+}
+
+/**
+ * @brief Lets the button IRQ go from the engine's CPU, back to
+ * the CPUs it could run on before it was first moved
+ */
+static void kcylon_uncolocate(void)
+{
+	if (engine_cpu < 0)
+		return;
+	WRITE_ONCE(engine_cpu, -1);
+	irq_set_affinity_hint(irq_number, NULL);
+	irq_set_affinity(irq_number, &irq_home);
+}
+
+/**
+ * @brief Keeps the button IRQ on the engine's CPU, following
+ * the engine if the scheduler moves it, or lets it go when
+ * colocate is turned off
+ *
+ * Only the engine thread calls this.
+ */
+static void kcylon_colocate(void)
+{
+	int cpu = raw_smp_processor_id();
+	if (READ_ONCE(colocate) && cpu != engine_cpu) {
+		WRITE_ONCE(engine_cpu, cpu);
+		irq_set_affinity_hint(irq_number, cpumask_of(cpu));
+	} else if (!READ_ONCE(colocate)) {
+		kcylon_uncolocate();
+	}
+}
+
+/**
+ * @brief kthread main loop
+ *
+ * @param void pointer which isn't used
+ * @return returns 0 upon success
+ */
+static int cylon(void *v)
+{
+	unsigned int i, j;
+	ktime_t next = ktime_get();
+	printk(KERN_INFO "KCYLON: Thread has started\n");
+	for (i = 0; i < num_strips; i++) {
+		strips[i].deadline = next;
+		strips[i].next_change = next;
+		for (j = 0; j < strips[i].num_segments; j++)
+			strips[i].segments[j].deadline = next;
+	}
+	while (!kthread_should_stop()) {
+		set_current_state(TASK_RUNNING);
+		kcylon_colocate();
+		next = KTIME_MAX;
+		for (i = 0; i < num_strips; i++) {
+			struct kcylon_strip *strip = &strips[i];
+			ktime_t start = ktime_get();
+			if (ktime_before(start, strip->deadline) && !READ_ONCE(strip->redraw)) {
+				next = min(next, strip->deadline);
+				continue;
+			}
+			this_cpu_inc(strip->stats->wakeups);
+			if (kcylon_strip_step(strip, start))
+				this_cpu_inc(strip->stats->frames);
+			this_cpu_add(strip->stats->frame_ns, ktime_to_ns(ktime_sub(ktime_get(), start)));
+			kcylon_stats_roll(strip, start);
+			next = min(next, strip->deadline);
+		}
+		set_current_state(TASK_INTERRUPTIBLE);
+		/* a layer pushed since the strip was looked at */
+		for (i = 0; i < num_strips; i++)
+			if (READ_ONCE(strips[i].redraw))
+				next = 0;
+		schedule_hrtimeout_range(&next, frame_slack_us * NSEC_PER_USEC, HRTIMER_MODE_ABS_PINNED);
+	}
+	printk(KERN_INFO "KCYLON: Thread has completed\n");
+	return 0;
+}
+
+/**
+ * @brief Prints one set of counters as a line of the stats file
+ */
+static void kcylon_stats_show_line(struct seq_file *m, const char *label, const struct kcylon_stats *s)
+{
+	seq_printf(m, "%-8s %12llu %12llu %14llu %12llu %14llu %10llu %12llu\n", label,
+		   s->wakeups, s->frames, s->frame_ns, s->gpio_writes, s->gpio_ns, s->irqs, s->irq_ns);
+}
+
+/**
+ * @brief Shows the cost counters of every strip, per CPU, in
+ * total and as a rate over the last second
+ */
+static int kcylon_stats_show(struct seq_file *m, void *v)
+{
+	unsigned int i, j;
+	int cpu;
+	char label[16];
+	mutex_lock(&config_mutex);
+	for (i = 0; i < num_strips; i++) {
+		struct kcylon_strip *strip = &strips[i];
+		struct kcylon_stats total;
+		seq_printf(m, "strip %u%s\n", i, strip->rgb ? " rgb" : "");
+		for (j = 0; j < strip->num_banks; j++)
+			seq_printf(m, "bank %u chip %s leds %u%s\n", j, strip->banks[j].chip->label,
+				   strip->banks[j].count, strip->banks[j].cansleep ? " (can sleep)" : "");
+		for (j = 0; j < strip->num_segments; j++) {
+			struct kcylon_segment *seg = &strip->segments[j];
+			seq_printf(m, "segment %u leds %u-%u pattern %s level %d speed %s load %u%%\n", j, seg->first,
+				   seg->first + seg->num_leds - 1, patterns[seg->pattern].name, seg->level,
+				   speed_names[seg->speed], (seg->metric_load * 100) >> 16);
+		}
+		seq_printf(m, "%-8s %12s %12s %14s %12s %14s %10s %12s\n", "",
+			   "wakeups", "frames", "frame_ns", "gpio_writes", "gpio_ns", "irqs", "irq_ns");
+		for_each_possible_cpu(cpu) {
+			snprintf(label, sizeof(label), "cpu%d", cpu);
+			kcylon_stats_show_line(m, label, per_cpu_ptr(strip->stats, cpu));
+		}
+		kcylon_stats_sum(strip, &total);
+		kcylon_stats_show_line(m, "total", &total);
+		kcylon_stats_show_line(m, "per_sec", &strip->rate);
+		seq_printf(m, "metric_samples %llu metric_ns %llu metric_ns_avg %llu\n", total.metric_samples,
+			   total.metric_ns, total.metric_samples ? div64_u64(total.metric_ns, total.metric_samples) : 0);
+		seq_printf(m, "polls %llu poll_edges %llu poll_ns %llu polls_per_sec %llu\n", total.polls,
+			   total.poll_edges, total.poll_ns, strip->rate.polls);
+		seq_printf(m, "acks %llu ack_latency_avg_ns %llu ack_latency_max_ns %llu\n", strip->acks,
+			   strip->acks ? div64_u64(strip->ack_latency_ns, strip->acks) : 0,
+			   strip->ack_latency_max_ns);
+		seq_printf(m, "commands %llu applied_at_frames %llu\n", strip->cmds_taken, strip->cmds_frames);
+		seq_printf(m, "cmd_to_frame_last_ns %llu\n", strip->cmd_latency_last_ns);
+		for (j = 0; j < 2; j++)
+			seq_printf(m, "cmd_to_frame %s count %llu avg_ns %llu max_ns %llu\n",
+				   j ? "colocated" : "spread", strip->cmd_latencies[j],
+				   strip->cmd_latencies[j] ? div64_u64(strip->cmd_latency_ns[j], strip->cmd_latencies[j]) : 0,
+				   strip->cmd_latency_max_ns[j]);
+	}
+	seq_printf(m, "refresh_hz %u\n", refresh_hz);
+	seq_printf(m, "keyframes_written %llu keyframes_reached %llu\n", keyframes_written, keyframes_reached);
+	seq_printf(m, "press_interval_ns %lld\n", press_interval_ns);
+	seq_printf(m, "trace_events %u replay_divergences %u\n", atomic_read(&trace_head), replay_divergences);
+	if (sense_pin >= 0)
+		seq_printf(m, "sense sweeps %u occupancy %016llx\n", READ_ONCE(sense_last.seq), (unsigned long long)READ_ONCE(sense_last.occupancy));
+	mutex_unlock(&config_mutex);
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(kcylon_stats);
+
+/**
+ * @brief Shows how long each output of every strip has been
+ * lit, and how many were lit on average, since load
+ */
+static int kcylon_ontime_show(struct seq_file *m, void *v)
+{
+	unsigned int i, j;
+	mutex_lock(&config_mutex);
+	for (i = 0; i < num_strips; i++) {
+		struct kcylon_strip *strip = &strips[i];
+		u64 now, elapsed, lit_ns;
+		mutex_lock(&strip->out_lock);
+		now = ktime_get_ns();
+		elapsed = max(now - strip->ontime_start, 1ULL);
+		lit_ns = strip->lit_ns + bitmap_weight(strip->shown, strip->num_outputs) * (now - strip->shown_since);
+		seq_printf(m, "strip %u elapsed_ns %llu lit_avg_milli %llu\n", i, elapsed,
+			   mul_u64_u64_div_u64(lit_ns, 1000, elapsed));
+		for (j = 0; j < strip->num_outputs; j++) {
+			u64 on = strip->on_ns[j];
+			if (test_bit(j, strip->shown))
+				on += now - strip->on_since[j];
+			seq_printf(m, "output %u on_ns %llu duty_milli %llu\n", j, on, mul_u64_u64_div_u64(on, 1000, elapsed));
+		}
+		mutex_unlock(&strip->out_lock);
+	}
+	mutex_unlock(&config_mutex);
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(kcylon_ontime);
+
+/**
+ * @brief Snapshots the trace ring as a binary trace when the
+ * trace file is opened
+ */
+static int kcylon_trace_open(struct inode *inode, struct file *file)
+{
+	struct kcylon_trace_header *hdr;
+	struct kcylon_trace_entry *out;
+	u32 head = atomic_read(&trace_head);
+	u32 seq = head > KCYLON_TRACE_LEN ? head - KCYLON_TRACE_LEN + 1 : 1;
+	unsigned int count = 0;
+	hdr = kvmalloc(sizeof(*hdr) + KCYLON_TRACE_LEN * sizeof(*out), GFP_KERNEL);
+	if (!hdr)
+		return -ENOMEM;
+	out = (struct kcylon_trace_entry *)(hdr + 1);
+	for (; seq <= head; seq++) {
+		struct kcylon_trace_entry *e = &trace_ring[(seq - 1) & (KCYLON_TRACE_LEN - 1)];
+		if (READ_ONCE(e->seq) != seq)
+			continue;
+		smp_rmb();
+		out[count] = *e;
+		smp_rmb();
+		if (READ_ONCE(e->seq) == seq && out[count].seq == seq)
+			count++;
+	}
+	hdr->magic = KCYLON_TRACE_MAGIC;
+	hdr->version = KCYLON_TRACE_VERSION;
+	hdr->entry_size = sizeof(*out);
+	hdr->count = count;
+	hdr->reserved = 0;
+	file->private_data = hdr;
+	return 0;
+}
+
+static ssize_t kcylon_trace_read(struct file *file, char __user *ubuf, size_t len, loff_t *ppos)
+{
+	struct kcylon_trace_header *hdr = file->private_data;
+	return simple_read_from_buffer(ubuf, len, ppos, hdr,
+				       sizeof(*hdr) + hdr->count * sizeof(struct kcylon_trace_entry));
+}
+
+static int kcylon_trace_release(struct inode *inode, struct file *file)
+{
+	kvfree(file->private_data);
+	return 0;
+}
+
+static const struct file_operations kcylon_trace_fops = {
+	.owner = THIS_MODULE,
+	.open = kcylon_trace_open,
+	.read = kcylon_trace_read,
+	.release = kcylon_trace_release,
+	.llseek = default_llseek,
+};
+
+/**
+ * @brief Replays a trace, keeping the gaps between its events
+ * divided by replay_speed
+ *
+ * @param v void pointer which isn't used
+ * @return returns 0 upon success
+ */
+static int kcylon_replay(void *v)
+{
+	unsigned int speed = max(replay_speed, 1U);
+	ktime_t start = ktime_get();
+	unsigned int i;
+	printk(KERN_INFO "KCYLON: Replaying %u events at %ux\n", replay_count, speed);
+	for (i = 0; i < replay_count && !kthread_should_stop(); i++) {
+		const struct kcylon_trace_entry *e = &replay_entries[i];
+		ktime_t at = ktime_add_ns(start, div_u64(e->time_ns - replay_entries[0].time_ns, speed));
+		set_current_state(TASK_INTERRUPTIBLE);
+		schedule_hrtimeout_range(&at, frame_slack_us * NSEC_PER_USEC, HRTIMER_MODE_ABS);
+		if (kthread_should_stop())
+			break;
+		if (e->strip >= num_strips || e->segment >= strips[e->strip].num_segments ||
+		    e->cmd >= KCYLON_CMD_MAX)
+			continue;
+		kcylon_strip_command(e->strip, e->segment, e->cmd, KCYLON_SRC_REPLAY, ktime_get(), e);
+		kcylon_strip_ack(&strips[e->strip], ktime_get());
+	}
+	printk(KERN_INFO "KCYLON: Replay done, %u divergences\n", replay_divergences);
+	while (!kthread_should_stop()) {
+		set_current_state(TASK_INTERRUPTIBLE);
+		schedule();
+	}
+	__set_current_state(TASK_RUNNING);
+	return 0;
+}
+
+/**
+ * @brief Stops the replay thread if there is one
+ *
+ * Called with replay_mutex held.
+ */
+static void kcylon_replay_stop(void)
+{
+	if (!replay_task)
+		return;
+	kthread_stop(replay_task);
+	replay_task = NULL;
+	kvfree(replay_entries);
+	replay_entries = NULL;
+}
+
+/**
+ * @brief Collects a binary trace written to the replay file
+ */
+static int kcylon_replay_open(struct inode *inode, struct file *file)
+{
+	size_t size = sizeof(struct kcylon_trace_header) +
+		      KCYLON_TRACE_LEN * sizeof(struct kcylon_trace_entry);
+	file->private_data = kvzalloc(size + sizeof(size_t), GFP_KERNEL);
+	return file->private_data ? 0 : -ENOMEM;
+}
+
+static ssize_t kcylon_replay_write(struct file *file, const char __user *ubuf, size_t len, loff_t *ppos)
+{
+	size_t *used = file->private_data;
+	size_t size = sizeof(struct kcylon_trace_header) +
+		      KCYLON_TRACE_LEN * sizeof(struct kcylon_trace_entry);
+	ssize_t ret = simple_write_to_buffer(used + 1, size, ppos, ubuf, len);
+	if (ret > 0)
+		*used = max_t(size_t, *used, *ppos);
+	return ret;
+}
+
+/**
+ * @brief Starts replaying the trace once the replay file is
+ * closed, replacing any replay still running
+ */
+static int kcylon_replay_release(struct inode *inode, struct file *file)
+{
+	size_t *used = file->private_data;
+	struct kcylon_trace_header *hdr = (struct kcylon_trace_header *)(used + 1);
+	struct kcylon_trace_entry *entries;
+	int ret = 0;
+	if (*used < sizeof(*hdr) || hdr->magic != KCYLON_TRACE_MAGIC ||
+	    hdr->version != KCYLON_TRACE_VERSION || hdr->entry_size != sizeof(*entries) ||
+	    !hdr->count || hdr->count > KCYLON_TRACE_LEN ||
+	    *used < sizeof(*hdr) + hdr->count * sizeof(*entries)) {
+		printk(KERN_INFO "KCYLON: Rejected a malformed trace\n");
+		kvfree(used);
+		return -EINVAL;
+	}
+	entries = kvmalloc_array(hdr->count, sizeof(*entries), GFP_KERNEL);
+	if (!entries) {
+		kvfree(used);
+		return -ENOMEM;
+	}
+	memcpy(entries, hdr + 1, hdr->count * sizeof(*entries));
+
+	mutex_lock(&replay_mutex);
+	kcylon_replay_stop();
+	replay_entries = entries;
+	replay_count = hdr->count;
+	replay_divergences = 0;
+	replay_task = kthread_run(kcylon_replay, NULL, "KCYLON_replay");
+	if (IS_ERR(replay_task)) {
+		ret = PTR_ERR(replay_task);
+		replay_task = NULL;
+		kvfree(entries);
+		replay_entries = NULL;
+	}
+	mutex_unlock(&replay_mutex);
+	kvfree(used);
+	return ret;
+}
+
+static const struct file_operations kcylon_replay_fops = {
+	.owner = THIS_MODULE,
+	.open = kcylon_replay_open,
+	.write = kcylon_replay_write,
+	.release = kcylon_replay_release,
+};
+
+/**
+ * @brief Pushes a user overlay layer written to debugfs
+ *
+ * The format is "<strip> <or|xor|replace> <bits> <mask>
+ * <lifetime_ms> [<blink_ms>]" with the bitmaps in hex,
+ * LED 0 being the lowest bit.
+ */
+static ssize_t kcylon_overlay_write(struct file *file, const char __user *ubuf, size_t len, loff_t *ppos)
+{
+	static const char * const blends[] = {
+		[KCYLON_BLEND_OR] = "or",
+		[KCYLON_BLEND_XOR] = "xor",
+		[KCYLON_BLEND_REPLACE] = "replace",
+	};
+	DECLARE_BITMAP(bits, KCYLON_MAX_LEDS);
+	DECLARE_BITMAP(mask, KCYLON_MAX_LEDS);
+	unsigned int strip, lifetime_ms, blink_ms = 0;
+	unsigned long long bits64, mask64;
+	char buf[96], mode[8];
+	int blend, ret;
+	if (len >= sizeof(buf))
+		return -EINVAL;
+	if (copy_from_user(buf, ubuf, len))
+		return -EFAULT;
+	buf[len] = '\0';
+	if (sscanf(buf, "%u %7s %llx %llx %u %u", &strip, mode, &bits64, &mask64, &lifetime_ms, &blink_ms) < 5)
+		return -EINVAL;
+	blend = match_string(blends, ARRAY_SIZE(blends), mode);
+	if (blend < 0)
+		return -EINVAL;
+	bitmap_from_u64(bits, bits64);
+	bitmap_from_u64(mask, mask64);
+	mutex_lock(&config_mutex);
+	ret = strip < num_strips ? kcylon_layer_push(&strips[strip], bits, mask, blend, KCYLON_LAYER_USER,
+						     lifetime_ms, blink_ms) : -EINVAL;
+	mutex_unlock(&config_mutex);
+	return ret ? ret : len;
+}
+
+static const struct file_operations kcylon_overlay_fops = {
+	.owner = THIS_MODULE,
+	.open = simple_open,
+	.write = kcylon_overlay_write,
+};
+
+/**
+ * @brief Queues a keyframe on its segment
+ *
+ * @param kfr the keyframe
+ * @return returns 0 if it was queued, -ENOSPC if the queue is
+ * full, -EINVAL if its segment doesn't exist
+ */
+static int kcylon_keyframe_push(const struct kcylon_keyframe *kfr)
+{
+	struct kcylon_strip *strip = &strips[kfr->strip % KCYLON_MAX_STRIPS];
+	struct kcylon_segment *seg = &strip->segments[kfr->segment % KCYLON_MAX_SEGMENTS];
+	struct kcylon_keyframes *kf = &seg->kf;
+	unsigned int slot;
+	int ret = -ENOSPC;
+	mutex_lock(&config_mutex);
+	if (kfr->strip >= num_strips || kfr->segment >= strip->num_segments || kfr->count > KCYLON_MAX_LEDS) {
+		mutex_unlock(&config_mutex);
+		return -EINVAL;
+	}
+	mutex_lock(&strip->out_lock);
+	if (kf->count < KCYLON_MAX_KEYFRAMES) {
+		/* a segment holding its last keyframe isn't due at all */
+		if (!kf->count) {
+			kf->from_time = ktime_get();
+			seg->deadline = min(seg->deadline, kf->from_time);
+		}
+		slot = (kf->head + kf->count++) % KCYLON_MAX_KEYFRAMES;
+		kf->queue[slot].delay_ms = max(kfr->delay_ms, 1U);
+		memset(kf->queue[slot].intensity, 0, sizeof(kf->queue[slot].intensity));
+		memcpy(kf->queue[slot].intensity, kfr->intensity, min_t(unsigned int, kfr->count, seg->num_leds));
+		seg->pattern = KCYLON_PATTERN_KEYFRAMES;
+		keyframes_written++;
+		ret = 0;
+	}
+	mutex_unlock(&strip->out_lock);
+	if (!ret)
+		kcylon_engine_wake(strip);
+	mutex_unlock(&config_mutex);
+	return ret;
+}
+
+/**
+ * @brief Takes keyframes written to /dev/kcylon
+ *
+ * Keyframes are taken whole. If a queue is full the write
+ * returns what has been taken so far, or blocks until the
+ * engine has made room unless the file is non-blocking.
  */
-static unsigned int button_pin = 27;
+static ssize_t kcylon_dev_write(struct file *file, const char __user *ubuf, size_t len, loff_t *ppos)
+{
+	struct kcylon_keyframe kfr;
+	size_t done = 0;
+	int ret;
+	if (len < sizeof(kfr))
+		return -EINVAL;
+	while (len - done >= sizeof(kfr)) {
+		if (copy_from_user(&kfr, ubuf + done, sizeof(kfr)))
+			return done ? done : -EFAULT;
+		while ((ret = kcylon_keyframe_push(&kfr)) == -ENOSPC) {
+			if (done)
+				return done;
+			if (file->f_flags & O_NONBLOCK)
+				return -EAGAIN;
+			ret = wait_event_interruptible(kcylon_wait,
+				strips[kfr.strip].segments[kfr.segment].kf.count < KCYLON_MAX_KEYFRAMES);
+			if (ret)
+				return ret;
+		}
+		if (ret)
+			return done ? done : ret;
+		done += sizeof(kfr);
+	}
+	return done;
+}
 
 /**
- * @brief The default sleep time in milliseconds
+ * @brief Remembers the sweep current when /dev/kcylon is
+ * opened, so reads wait for the next one
  */
-static unsigned int sleep_time = 100;
+static int kcylon_dev_open(struct inode *inode, struct file *file)
+{
+	file->private_data = (void *)(unsigned long)READ_ONCE(sense_last.seq);
+	return nonseekable_open(inode, file);
+}
 
 /**
- * @brief The variable the button alters, so
- * consequently, it must have a mutex to make
- * sure the threads aren't using it at the same
- * time
+ * @brief Reads the occupancy of the latest sense sweep as a
+ * struct kcylon_sweep, waiting for one newer than the last
+ * read unless the file is non-blocking
  */
-static volatile int button_level;
-static struct mutex button_level_mutex;
+static ssize_t kcylon_dev_read(struct file *file, char __user *ubuf, size_t len, loff_t *ppos)
+{
+	u32 seen = (unsigned long)file->private_data;
+	struct kcylon_sweep sweep;
+	unsigned long flags;
+	int ret;
+	if (sense_pin < 0)
+		return -ENODEV;
+	if (len < sizeof(sweep))
+		return -EINVAL;
+	if (READ_ONCE(sense_last.seq) == seen) {
+		if (file->f_flags & O_NONBLOCK)
+			return -EAGAIN;
+		ret = wait_event_interruptible(sense_wait, READ_ONCE(sense_last.seq) != seen);
+		if (ret)
+			return ret;
+	}
+	spin_lock_irqsave(&sense_lock, flags);
+	sweep = sense_last;
+	spin_unlock_irqrestore(&sense_lock, flags);
+	if (copy_to_user(ubuf, &sweep, sizeof(sweep)))
+		return -EFAULT;
+	file->private_data = (void *)(unsigned long)sweep.seq;
+	return sizeof(sweep);
+}
 
 /**
- * @brief The direction the cylon beam is going in
+ * @brief /dev/kcylon is readable once a new sense sweep has
+ * completed, and writable while every keyframe queue has room
  */
-static int button_direction;
+static __poll_t kcylon_dev_poll(struct file *file, poll_table *wait)
+{
+	__poll_t mask = EPOLLOUT;
+	unsigned int i, j;
+	poll_wait(file, &kcylon_wait, wait);
+	poll_wait(file, &sense_wait, wait);
+	if (sense_pin >= 0 && READ_ONCE(sense_last.seq) != (unsigned long)file->private_data)
+		mask |= EPOLLIN | EPOLLRDNORM;
+	for (i = 0; i < num_strips; i++)
+		for (j = 0; j < strips[i].num_segments; j++)
+			if (READ_ONCE(strips[i].segments[j].kf.count) >= KCYLON_MAX_KEYFRAMES)
+				mask &= ~EPOLLOUT;
+	return mask;
+}
+
+static const struct file_operations kcylon_dev_fops = {
+	.owner = THIS_MODULE,
+	.open = kcylon_dev_open,
+	.read = kcylon_dev_read,
+	.write = kcylon_dev_write,
+	.poll = kcylon_dev_poll,
+	.llseek = no_llseek,
+};
+
+static struct miscdevice kcylon_misc = {
+	.minor = MISC_DYNAMIC_MINOR,
+	.name = "kcylon",
+	.fops = &kcylon_dev_fops,
+};
 
 /**
- * @brief The ID of the button for the IRQ interrupts
+ * @brief Acts on a key of the matrix going down
+ *
+ * @param key the key, numbered row by row
  */
-static int irq_number;
+static void kcylon_matrix_key(unsigned int key)
+{
+	static const enum kcylon_cmd columns[] = {
+		KCYLON_CMD_FASTER, KCYLON_CMD_SLOWER, KCYLON_CMD_PATTERN,
+	};
+	unsigned int strip, segment = 0, cmd;
+	if (key < num_matrix_keymap) {
+		segment = matrix_keymap[key] >> 16;
+		strip = (matrix_keymap[key] >> 8) & 0xff;
+		cmd = matrix_keymap[key] & 0xff;
+	} else {
+		strip = key / num_matrix_cols;
+		cmd = columns[key % num_matrix_cols % ARRAY_SIZE(columns)];
+	}
+	/* a key going down while the config is replaced is dropped */
+	if (READ_ONCE(config_applying))
+		return;
+	mutex_lock(&config_mutex);
+	if (strip < num_strips && segment < strips[strip].num_segments && cmd < KCYLON_CMD_MAX) {
+		kcylon_strip_command(strip, segment, cmd, KCYLON_SRC_MATRIX, matrix_edge, NULL);
+		kcylon_strip_ack(&strips[strip], matrix_edge);
+	}
+	mutex_unlock(&config_mutex);
+}
 
 /**
- * @brief The struct containing info on the worker thread
+ * @brief Drives every row so that any key going down raises
+ * a column interrupt
  */
-static struct task_struct *task;
+static void kcylon_matrix_drive_all(void)
+{
+	unsigned int r;
+	for (r = 0; r < num_matrix_rows; r++)
+		gpio_set_value_cansleep(matrix_rows[r], true);
+}
 
 /**
- * @brief Benchmarking variables
+ * @brief Keypad matrix column interrupt handler
+ *  Masks the columns and starts scanning. The
+ *  scan unmasks them again once every key is up.
+ *
+ * @param irq The irq number of the column
+ * @return returns IRQ_HANDLED which tells the kernel that this is a non-fatal interrupt
  */
-static struct timespec ts_current, ts_last, ts_diff;
+static irqreturn_t kcylon_matrix_irq(int irq, void *dev_id)
+{
+	unsigned int c;
+	if (READ_ONCE(matrix_stopping) || atomic_xchg(&matrix_scanning, 1))
+		return IRQ_HANDLED;
+	matrix_edge = ktime_get();
+	for (c = 0; c < num_matrix_cols; c++)
+		disable_irq_nosync(matrix_irqs[c]);
+	schedule_delayed_work(&matrix_work, 0);
+	return IRQ_HANDLED;
+}
 
 /**
- * @brief Prototype for the irq handler
+ * @brief Scans the keypad matrix while any key is down
  *
- * Used as a callback for button presses
+ * Each row is driven on its own and the columns read. A key
+ * changes state once it has read the same for matrix_debounce
+ * scans in a row. When all keys are up the rows are driven
+ * together again and the column interrupts unmasked, so an
+ * idle keypad costs no wakeups at all.
  */
-static irq_handler_t kcylon_irq_handler(unsigned int irq, void *dev_id, struct pt_regs *regs);
+static void kcylon_matrix_scan(struct work_struct *work)
+{
+	DECLARE_BITMAP(raw, KCYLON_MATRIX_MAX * KCYLON_MATRIX_MAX);
+	unsigned int r, c, key, keys = num_matrix_rows * num_matrix_cols;
+	bool busy = false;
+	bitmap_zero(raw, KCYLON_MATRIX_MAX * KCYLON_MATRIX_MAX);
+	for (r = 0; r < num_matrix_rows; r++) {
+		for (c = 0; c < num_matrix_rows; c++)
+			gpio_set_value_cansleep(matrix_rows[c], c == r);
+		udelay(matrix_settle_us);
+		for (c = 0; c < num_matrix_cols; c++)
+			if (gpio_get_value_cansleep(matrix_cols[c]))
+				__set_bit(r * num_matrix_cols + c, raw);
+	}
+	for (key = 0; key < keys; key++) {
+		bool down = test_bit(key, raw);
+		if (down == test_bit(key, matrix_down)) {
+			matrix_count[key] = 0;
+		} else if (++matrix_count[key] >= matrix_debounce) {
+			matrix_count[key] = 0;
+			__assign_bit(key, matrix_down, down);
+			if (down)
+				kcylon_matrix_key(key);
+		}
+		if (down || test_bit(key, matrix_down))
+			busy = true;
+	}
+	kcylon_matrix_drive_all();
+	if (busy && !READ_ONCE(matrix_stopping)) {
+		schedule_delayed_work(&matrix_work, msecs_to_jiffies(matrix_scan_ms));
+		return;
+	}
+	if (READ_ONCE(matrix_stopping))
+		return;
+	atomic_set(&matrix_scanning, 0);
+	for (c = 0; c < num_matrix_cols; c++)
+		enable_irq(matrix_irqs[c]);
+	/* a key may have gone down before the interrupts were back */
+	for (c = 0; c < num_matrix_cols; c++)
+		if (gpio_get_value_cansleep(matrix_cols[c]))
+			kcylon_matrix_irq(matrix_irqs[c], NULL);
+}
 
 /**
- * @brief kthread main loop
+ * @brief Sets up the keypad matrix, if it has been given
  *
- * @param void pointer which isn't used
- * @return returns 0 upon success
+ * @return returns 0 on success, a negative errno otherwise
  */
-static int cylon(void *v)
+static int kcylon_matrix_init(void)
 {
-	int current_led = 0;
-	int last_led = 0;
-	bool rising = 1;
-	unsigned int thread_sleep_time = sleep_time;
-	printk(KERN_INFO "KCYLON: Thread has started\n");
-	while (!kthread_should_stop()) {
-		set_current_state(TASK_RUNNING);
-		if (last_led >= 0 && last_led <= 9)
-			gpio_set_value(led_pins[last_led], false);
-		gpio_set_value(led_pins[current_led], true);
+	unsigned int i;
+	int ret;
+	if (!num_matrix_rows || !num_matrix_cols)
+		return 0;
+	INIT_DELAYED_WORK(&matrix_work, kcylon_matrix_scan);
+	for (i = 0; i < num_matrix_rows; i++) {
+		gpio_request(matrix_rows[i], "sysfs");
+		gpio_direction_output(matrix_rows[i], true);
+	}
+	for (i = 0; i < num_matrix_cols; i++) {
+		gpio_request(matrix_cols[i], "sysfs");
+		gpio_direction_input(matrix_cols[i]);
+		matrix_irqs[i] = gpio_to_irq(matrix_cols[i]);
+		ret = request_irq(matrix_irqs[i], kcylon_matrix_irq,
+				  IRQF_TRIGGER_RISING | IRQF_TRIGGER_FALLING, "kcylon_matrix", NULL);
+		if (ret) {
+			printk(KERN_INFO "KCYLON: Couldn't create an interrupt handler for matrix column %u\n", i);
+			gpio_free(matrix_cols[i]);
+			while (i--) {
+				free_irq(matrix_irqs[i], NULL);
+				gpio_free(matrix_cols[i]);
+			}
+			for (i = 0; i < num_matrix_rows; i++)
+				gpio_free(matrix_rows[i]);
+			return ret;
+		}
+	}
+	printk(KERN_INFO "KCYLON: Keypad matrix of %u rows and %u columns\n", num_matrix_rows, num_matrix_cols);
+	return 0;
+}
 
-		if (rising)
-			last_led = current_led++;
-		else
-			last_led = current_led--;
-		if (current_led > 9) {
-			current_led = 9;
-			rising = 0;
-		}
-		if (current_led < 0) {
-			current_led = 0;
-			rising = 1;
-		}
-		mutex_lock(&button_level_mutex);
-		if (button_level > 0)
-			thread_sleep_time = sleep_time * button_level;
-		else if (button_level < 0)
-			thread_sleep_time = sleep_time / (-1 * button_level);
-		else
-			thread_sleep_time = sleep_time;
-		mutex_unlock(&button_level_mutex);
-		set_current_state(TASK_INTERRUPTIBLE);
-		msleep(thread_sleep_time);
+/**
+ * @brief Stops scanning the keypad matrix and frees its pins
+ */
+static void kcylon_matrix_exit(void)
+{
+	unsigned int i;
+	if (!num_matrix_rows || !num_matrix_cols)
+		return;
+	WRITE_ONCE(matrix_stopping, true);
+	cancel_delayed_work_sync(&matrix_work);
+	for (i = 0; i < num_matrix_cols; i++) {
+		free_irq(matrix_irqs[i], NULL);
+		gpio_free(matrix_cols[i]);
+	}
+	cancel_delayed_work_sync(&matrix_work);
+	for (i = 0; i < num_matrix_rows; i++) {
+		gpio_set_value_cansleep(matrix_rows[i], false);
+		gpio_free(matrix_rows[i]);
+	}
+}
+
+/**
+ * @brief Groups a strip's LEDs by the GPIO chip they are on
+ *
+ * @param strip the strip, whose pins must have been requested
+ * @return returns 0 on success, -EINVAL if it spans too many chips
+ */
+static int kcylon_banks_init(struct kcylon_strip *strip)
+{
+	unsigned int i, b;
+	for (i = 0; i < strip->num_outputs; i++) {
+		struct gpio_desc *desc = gpio_to_desc(strip->pins[i]);
+		struct gpio_chip *chip = gpiod_to_chip(desc);
+		struct kcylon_bank *bank;
+		for (b = 0; b < strip->num_banks; b++)
+			if (strip->banks[b].chip == chip)
+				break;
+		if (b == KCYLON_MAX_BANKS) {
+			printk(KERN_INFO "KCYLON: The strip spans more than %d GPIO chips\n", KCYLON_MAX_BANKS);
+			return -EINVAL;
+		}
+		bank = &strip->banks[b];
+		if (b == strip->num_banks) {
+			strip->num_banks++;
+			bank->chip = chip;
+			bank->cansleep = gpiod_cansleep(desc);
+		}
+		bank->descs[bank->count] = desc;
+		bank->leds[bank->count++] = i;
+		__set_bit(i, bank->mask);
 	}
-	printk(KERN_INFO "KCYLON: Thread has completed\n");
 	return 0;
 }
 
 /**
- * @brief Kernel module entry point
- * Sets up all of the GPIOs and the button
- * interrupts
+ * @brief Splits a strip into segments. Strip 0 is split as
+ * given by the segment parameters, the others are one segment.
  *
- * @return returns 0 on success, -ENODEV if gpio isn't possible
+ * @param strip the strip to split
+ * @return returns 0 on success, -EINVAL if the segments don't fit
  */
-static int __init kcylon_init(void)
+static int kcylon_segments_init(struct kcylon_strip *strip)
 {
-	int i, ret = 0;
-	mutex_init(&button_level_mutex);
-	button_level = 0;
-	button_direction = -1;
-	printk(KERN_INFO "KCYLON: Initializing kcylon module\n");
-	for (i = 0; i < NUM_LEDS; i++) {
-		if (!gpio_is_valid(led_pins[i])) {
-			printk(KERN_INFO "KCYLON: LED pin %d (GPIO %d) is invalid\n", i + 1, led_pins[i]);
-			return -ENODEV;
+	bool split = strip == &strips[0] && num_segment_leds;
+	unsigned int i, first = 0;
+	strip->num_segments = split ? num_segment_leds : 1;
+	for (i = 0; i < strip->num_segments; i++) {
+		struct kcylon_segment *seg = &strip->segments[i];
+		seg->first = first;
+		seg->num_leds = split ? segment_leds[i] : strip->num_leds;
+		seg->rising = 1;
+		if (strip == &strips[0] && i < num_segment_patterns)
+			seg->pattern = segment_patterns[i] % ARRAY_SIZE(patterns);
+		if (strip == &strips[0] && i < num_segment_levels)
+			seg->level = clamp(segment_levels[i], -9, 9);
+		atomic64_set(&seg->cmds, kcylon_cmds_pack(seg->level, -1, 0, 0));
+		if (strip == &strips[0] && i < num_segment_speeds)
+			seg->speed = segment_speeds[i] % KCYLON_SPEED_MAX;
+		first += seg->num_leds;
+		if (!seg->num_leds || first > strip->num_leds) {
+			printk(KERN_INFO "KCYLON: Segment %u doesn't fit in the strip\n", i);
+			return -EINVAL;
+		}
+	}
+	if (strip == &strips[0] && button_segment >= strip->num_segments) {
+		printk(KERN_INFO "KCYLON: The button's segment %u doesn't exist\n", button_segment);
+		return -EINVAL;
+	}
+	return 0;
+}
+
+/**
+ * @brief Sets up the RGB strip as strip 1, if its pins have
+ * been given
+ *
+ * @return returns 0 on success, -EINVAL if the pins aren't triplets
+ */
+static int kcylon_rgb_init(void)
+{
+	struct kcylon_strip *strip = &strips[1];
+	unsigned int i, c, n = num_rgb_pins / 3;
+	if (!num_rgb_pins)
+		return 0;
+	if (num_rgb_pins % 3) {
+		printk(KERN_INFO "KCYLON: The RGB pins aren't red, green, blue triplets\n");
+		return -EINVAL;
+	}
+	for (i = 0; i < n; i++)
+		for (c = 0; c < 3; c++)
+			rgb_outputs[c * n + i] = rgb_pins[3 * i + c];
+	strip->pins = rgb_outputs;
+	strip->num_leds = n;
+	strip->num_outputs = num_rgb_pins;
+	strip->rgb = true;
+	for (i = 0; i < ARRAY_SIZE(strip->palette); i++)
+		strip->palette[i] = i < num_rgb_palette ? rgb_palette[i] & 0xfff : i << 8;
+	num_strips = 2;
+	return 0;
+}
+
+/**
+ * @brief Polls the button while its IRQ is masked
+ *
+ * A rising level is a press, applied as the IRQ thread would
+ * but without the acknowledgement flash, which can't be shown
+ * from a timer. Once the line has been quiet for poll_quiet_ms
+ * its IRQ is unmasked again, unless the button is being torn
+ * down.
+ */
+static enum hrtimer_restart kcylon_button_poll(struct hrtimer *timer)
+{
+	ktime_t now = ktime_get();
+	int level = gpio_get_value(button_pin);
+	this_cpu_inc(strips[0].stats->polls);
+	if (level && !button_poll_level) {
+		press_edge = now;
+		press_interval_ns = ktime_to_ns(ktime_sub(now, press_last));
+		press_last = now;
+		button_poll_edge = now;
+		kcylon_strip_command(0, button_segment, KCYLON_CMD_PRESS, KCYLON_SRC_BUTTON, now, NULL);
+		this_cpu_inc(strips[0].stats->poll_edges);
+	}
+	button_poll_level = level;
+	if (ktime_after(now, ktime_add_ms(button_poll_edge, poll_quiet_ms))) {
+		if (READ_ONCE(button_stopping))
+			return HRTIMER_NORESTART;
+		WRITE_ONCE(button_polling, false);
+		button_burst = 0;
+		enable_irq(irq_number);
+		this_cpu_add(strips[0].stats->poll_ns, ktime_to_ns(ktime_sub(ktime_get(), now)));
+		return HRTIMER_NORESTART;
+	}
+	hrtimer_forward_now(timer, us_to_ktime(max(poll_interval_us, 100U)));
+	this_cpu_add(strips[0].stats->poll_ns, ktime_to_ns(ktime_sub(ktime_get(), now)));
+	return HRTIMER_RESTART;
+}
+
+/**
+ * @brief Sets a strip's LEDs off and frees their pins, for
+ * every strip
+ */
+static void kcylon_pins_free(void)
+{
+	int i, j;
+	for (i = 0; i < num_strips; i++) {
+		for (j = 0; j < strips[i].num_outputs; j++) {
+			gpio_set_value(strips[i].pins[j], 0);
+			gpio_unexport(strips[i].pins[j]);
+			gpio_free(strips[i].pins[j]);
+		}
+	}
+}
+
+/**
+ * @brief Brings up the strips, the button and the engine as
+ * the current configuration describes them
+ *
+ * Everything set up is released again on failure, so a config
+ * which doesn't work can be rolled back.
+ *
+ * @return returns 0 on success, a negative errno otherwise
+ */
+static int kcylon_setup(void)
+{
+	struct task_struct *engine;
+	int i, j, ret;
+	for (i = 0; i < KCYLON_MAX_STRIPS; i++) {
+		memset(&strips[i], 0, sizeof(strips[i]));
+		spin_lock_init(&strips[i].layer_lock);
+		mutex_init(&strips[i].out_lock);
+	}
+	strips[0].pins = led_pins;
+	strips[0].num_leds = num_led_pins;
+	strips[0].num_outputs = num_led_pins;
+	num_strips = 1;
+	ret = -EINVAL;
+	if (kcylon_rgb_init())
+		goto free_stats;
+	if (refresh_hz)
+		refresh_hz = clamp(refresh_hz, 25U, 400U);
+	for (i = 0; i < num_strips; i++) {
+		if (kcylon_segments_init(&strips[i]))
+			goto free_stats;
+		for (j = 0; j < strips[i].num_outputs; j++) {
+			if (!gpio_is_valid(strips[i].pins[j])) {
+				printk(KERN_INFO "KCYLON: LED pin %d (GPIO %d) is invalid\n", j + 1, strips[i].pins[j]);
+				ret = -ENODEV;
+				goto free_stats;
+			}
+		}
+	}
+	if (sense_pin >= 0 && (sense_strip >= num_strips || sense_segment >= strips[sense_strip].num_segments)) {
+		printk(KERN_INFO "KCYLON: The sense pin %d follows segment %u of strip %u, which doesn't exist\n",
+		       sense_pin, sense_segment, sense_strip);
+		goto free_stats;
+	}
+	if (sense_pin >= 0 && (!gpio_is_valid(sense_pin) || gpio_cansleep(sense_pin))) {
+		printk(KERN_INFO "KCYLON: The sense pin %d can't be sampled from a timer\n", sense_pin);
+		goto free_stats;
+	}
+	for (i = 0; i < num_strips; i++) {
+		strips[i].bam_plane = -1;
+		strips[i].rate_stamp = ktime_get();
+		strips[i].ontime_start = ktime_to_ns(strips[i].rate_stamp);
+		strips[i].shown_since = strips[i].ontime_start;
+		strips[i].stats = alloc_percpu(struct kcylon_stats);
+		if (!strips[i].stats) {
+			printk(KERN_ALERT "KCYLON: Failed to allocate the counters for strip %d\n", i);
+			ret = -ENOMEM;
+			goto free_stats;
+		}
+	}
+	for (i = 0; i < num_strips; i++) {
+		for (j = 0; j < strips[i].num_outputs; j++) {
+			gpio_request(strips[i].pins[j], "sysfs");
+			gpio_direction_output(strips[i].pins[j], false);
+			gpio_export(strips[i].pins[j], false);
 		}
-		gpio_request(led_pins[i], "sysfs");
-		gpio_direction_output(led_pins[i], false);
-		gpio_export(led_pins[i], false);
 	}
+	ret = -EINVAL;
+	for (i = 0; i < num_strips; i++)
+		if (kcylon_banks_init(&strips[i]))
+			goto free_pins;
+	/* the button wakes the engine, so it exists before the IRQ does */
+	engine = kthread_create(cylon, NULL, "KCYLON_thread");
+	if (IS_ERR(engine)) {
+		printk(KERN_ALERT "KCYLON: Failed to create the thread\n");
+		ret = PTR_ERR(engine);
+		goto free_pins;
+	}
+	WRITE_ONCE(task, engine);
 	gpio_request(button_pin, "sysfs");
 	gpio_direction_input(button_pin);
 	gpio_set_debounce(button_pin, 200);
 	gpio_export(button_pin, false);
 
+	press_last = ktime_get();
+	button_polling = false;
+	button_stopping = false;
+	button_burst = 0;
+	hrtimer_init(&button_poll_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL_PINNED);
+	button_poll_timer.function = kcylon_button_poll;
+
 	irq_number = gpio_to_irq(button_pin);
 	printk(KERN_INFO "KCYLON: The button %u is mapped to IRQ %d\n", button_pin, irq_number);
 
-	if (request_irq(irq_number, (irq_handler_t) kcylon_irq_handler, IRQF_TRIGGER_RISING, "kcylon_button", NULL)) {
+	ret = request_threaded_irq(irq_number, kcylon_irq_handler, kcylon_irq_thread,
+				   IRQF_TRIGGER_RISING | IRQF_ONESHOT, "kcylon_button", NULL);
+	if (ret) {
 		printk(KERN_INFO "KCYLON: Couldn't create an interrupt handler for irq number %d\n", irq_number);
-		ret = -1;
+		goto free_button;
 	}
+	cpumask_copy(&irq_home, irq_get_affinity_mask(irq_number) ?: cpu_online_mask);
 
-	getnstimeofday(&ts_last);
-	ts_diff = timespec_sub(ts_last, ts_last); /* zero out diff */
+	if (sense_pin >= 0) {
+		gpio_request(sense_pin, "sysfs");
+		gpio_direction_input(sense_pin);
+		bitmap_zero(sense_bits, KCYLON_MAX_LEDS);
+		sense_samples = 0;
+		sense_sweep = 0;
+		sense_building = 0;
+		hrtimer_init(&sense_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL_PINNED);
+		sense_timer.function = kcylon_sense_sample;
+	}
 
-	task = kthread_run(cylon, NULL, "KCYLON_thread");
-	if (IS_ERR(task)) {
-		printk(KERN_ALERT "KCYLON: Failed to create the thread\n");
-		ret = PTR_ERR(task);
+	wake_up_process(engine);
+	kcylon_running = true;
+	return 0;
+
+free_button:
+	gpio_unexport(button_pin);
+	gpio_free(button_pin);
+	WRITE_ONCE(task, NULL);
+	kthread_stop(engine);
+free_pins:
+	kcylon_pins_free();
+free_stats:
+	for (i = 0; i < num_strips; i++)
+		free_percpu(strips[i].stats);
+	num_strips = 0;
+	return ret;
+}
+
+/**
+ * @brief Stops the engine and releases the button and the
+ * strips, undoing kcylon_setup()
+ *
+ * Called with config_mutex held, or at exit.
+ */
+static void kcylon_teardown(void)
+{
+	int i;
+	if (!kcylon_running)
+		return;
+	/*
+	 * The button's presses wake the engine, so it is quiet first.
+	 * Masking the IRQ waits out its handler, which could start
+	 * the poll timer, and a stopping poll leaves the IRQ masked.
+	 */
+	WRITE_ONCE(button_stopping, true);
+	disable_irq(irq_number);
+	hrtimer_cancel(&button_poll_timer);
+	if (button_polling)
+		enable_irq(irq_number);
+	kthread_stop(task);
+	WRITE_ONCE(task, NULL);
+	kcylon_uncolocate();
+	free_irq(irq_number, NULL);
+	if (sense_pin >= 0) {
+		hrtimer_cancel(&sense_timer);
+		gpio_free(sense_pin);
+	}
+	kcylon_pins_free();
+	gpio_unexport(button_pin);
+	gpio_free(button_pin);
+	for (i = 0; i < num_strips; i++)
+		free_percpu(strips[i].stats);
+	num_strips = 0;
+	kcylon_running = false;
+}
+
+/**
+ * @brief A segment of strip 0 as kept in a config blob
+ */
+struct kcylon_config_segment {
+	u8 num_leds;
+	u8 pattern;	/**< index into patterns[] */
+	s8 level;	/**< starting speed level, -9 to 9 */
+	u8 speed;	/**< enum kcylon_speed */
+};
+
+/**
+ * @brief A config blob, as read from and written to
+ * /dev/kcylon_config or loaded with the config parameter
+ *
+ * It holds everything fixed when the module is set up: the
+ * pins of both strips, how strip 0 is split into segments,
+ * and the period of each speed level. A blob is applied whole
+ * or not at all.
+ */
+struct kcylon_config {
+	u32 magic;	/**< KCYLON_CONFIG_MAGIC */
+	u16 version;	/**< KCYLON_CONFIG_VERSION */
+	u16 size;	/**< sizeof(struct kcylon_config) */
+	u32 button_pin;
+	u32 refresh_hz;
+	u8 num_led_pins;
+	u8 num_rgb_pins;
+	u8 num_segments;	/**< 0 for one segment over the whole of strip 0 */
+	u8 button_segment;
+	u32 led_pins[KCYLON_MAX_LEDS];
+	u32 rgb_pins[KCYLON_MAX_LEDS / 3 * 3];
+	u16 rgb_palette[1 << KCYLON_BAM_BITS];
+	struct kcylon_config_segment segments[KCYLON_MAX_SEGMENTS];
+	u32 speed_table[KCYLON_LEVELS];	/**< period in ms of each level, -10 first */
+};
+
+#define KCYLON_CONFIG_MAGIC 0x4746434b	/* "KCFG" */
+#define KCYLON_CONFIG_VERSION 1
+
+/**
+ * @brief Checks a config blob can be applied
+ *
+ * @return returns 0 if it can, -EINVAL if it is malformed,
+ * -ENODEV if it names a GPIO which doesn't exist
+ */
+static int kcylon_config_check(const struct kcylon_config *cfg)
+{
+	unsigned int i, leds = 0, segments = max_t(unsigned int, cfg->num_segments, 1);
+	if (cfg->magic != KCYLON_CONFIG_MAGIC || cfg->version != KCYLON_CONFIG_VERSION ||
+	    cfg->size != sizeof(*cfg))
+		return -EINVAL;
+	if (!cfg->num_led_pins || cfg->num_led_pins > KCYLON_MAX_LEDS ||
+	    cfg->num_rgb_pins > ARRAY_SIZE(rgb_pins) || cfg->num_rgb_pins % 3 ||
+	    cfg->num_segments > KCYLON_MAX_SEGMENTS || cfg->button_segment >= segments)
+		return -EINVAL;
+	for (i = 0; i < segments; i++) {
+		const struct kcylon_config_segment *seg = &cfg->segments[i];
+		if (seg->pattern >= ARRAY_SIZE(patterns) || seg->speed >= KCYLON_SPEED_MAX ||
+		    seg->level < -9 || seg->level > 9 || (cfg->num_segments && !seg->num_leds))
+			return -EINVAL;
+		leds += seg->num_leds;
+	}
+	if (leds > cfg->num_led_pins)
+		return -EINVAL;
+	for (i = 0; i < KCYLON_LEVELS; i++)
+		if (!cfg->speed_table[i] || cfg->speed_table[i] > KCYLON_PERIOD_MAX_MS)
+			return -EINVAL;
+	if (!gpio_is_valid(cfg->button_pin))
+		return -ENODEV;
+	for (i = 0; i < cfg->num_led_pins; i++)
+		if (!gpio_is_valid(cfg->led_pins[i]))
+			return -ENODEV;
+	for (i = 0; i < cfg->num_rgb_pins; i++)
+		if (!gpio_is_valid(cfg->rgb_pins[i]))
+			return -ENODEV;
+	return 0;
+}
+
+/**
+ * @brief Fills a config blob from the current configuration
+ *
+ * Called with config_mutex held, or before the module is up.
+ */
+static void kcylon_config_export(struct kcylon_config *cfg)
+{
+	unsigned int i;
+	memset(cfg, 0, sizeof(*cfg));
+	cfg->magic = KCYLON_CONFIG_MAGIC;
+	cfg->version = KCYLON_CONFIG_VERSION;
+	cfg->size = sizeof(*cfg);
+	cfg->button_pin = button_pin;
+	cfg->refresh_hz = refresh_hz;
+	cfg->num_led_pins = num_led_pins;
+	cfg->num_rgb_pins = num_rgb_pins;
+	cfg->num_segments = num_segment_leds;
+	cfg->button_segment = button_segment;
+	memcpy(cfg->led_pins, led_pins, sizeof(cfg->led_pins));
+	memcpy(cfg->rgb_pins, rgb_pins, sizeof(cfg->rgb_pins));
+	for (i = 0; i < ARRAY_SIZE(cfg->rgb_palette); i++)
+		cfg->rgb_palette[i] = i < num_rgb_palette ? rgb_palette[i] & 0xfff : i << 8;
+	for (i = 0; i < KCYLON_MAX_SEGMENTS; i++) {
+		cfg->segments[i].num_leds = segment_leds[i];
+		cfg->segments[i].pattern = i < num_segment_patterns ? segment_patterns[i] % ARRAY_SIZE(patterns) : 0;
+		cfg->segments[i].level = i < num_segment_levels ? clamp(segment_levels[i], -9, 9) : 0;
+		cfg->segments[i].speed = i < num_segment_speeds ? segment_speeds[i] % KCYLON_SPEED_MAX : 0;
+	}
+	memcpy(cfg->speed_table, speed_table, sizeof(cfg->speed_table));
+}
+
+/**
+ * @brief Makes a checked config blob the current configuration
+ *
+ * Only the parameters are changed. It takes effect when the
+ * module is next set up.
+ */
+static void kcylon_config_load(const struct kcylon_config *cfg)
+{
+	unsigned int i;
+	button_pin = cfg->button_pin;
+	refresh_hz = cfg->refresh_hz;
+	num_led_pins = cfg->num_led_pins;
+	num_rgb_pins = cfg->num_rgb_pins;
+	memcpy(led_pins, cfg->led_pins, sizeof(led_pins));
+	memcpy(rgb_pins, cfg->rgb_pins, sizeof(rgb_pins));
+	for (i = 0; i < ARRAY_SIZE(rgb_palette); i++)
+		rgb_palette[i] = cfg->rgb_palette[i];
+	num_rgb_palette = ARRAY_SIZE(rgb_palette);
+	num_segment_leds = cfg->num_segments;
+	num_segment_patterns = max_t(unsigned int, cfg->num_segments, 1);
+	num_segment_levels = num_segment_patterns;
+	num_segment_speeds = num_segment_patterns;
+	for (i = 0; i < KCYLON_MAX_SEGMENTS; i++) {
+		segment_leds[i] = cfg->segments[i].num_leds;
+		segment_patterns[i] = cfg->segments[i].pattern;
+		segment_levels[i] = cfg->segments[i].level;
+		segment_speeds[i] = cfg->segments[i].speed;
+	}
+	button_segment = cfg->button_segment;
+	memcpy(speed_table, cfg->speed_table, sizeof(speed_table));
+}
+
+/**
+ * @brief Replaces the running configuration with a config
+ * blob in one go
+ *
+ * The engine, button and strips are torn down and set up
+ * again from the blob. If that fails the previous config is
+ * set up again, so a bad blob leaves the module as it was.
+ *
+ * @return returns 0 on success, a negative errno otherwise
+ */
+static int kcylon_config_apply(const struct kcylon_config *cfg)
+{
+	struct kcylon_config *old;
+	ktime_t start = ktime_get();
+	int ret = kcylon_config_check(cfg);
+	if (ret) {
+		printk(KERN_INFO "KCYLON: Rejected a malformed config\n");
+		return ret;
+	}
+	old = kmalloc(sizeof(*old), GFP_KERNEL);
+	if (!old)
+		return -ENOMEM;
+	mutex_lock(&replay_mutex);
+	kcylon_replay_stop();
+	mutex_lock(&config_mutex);
+	WRITE_ONCE(config_applying, true);
+	kcylon_config_export(old);
+	kcylon_teardown();
+	kcylon_config_load(cfg);
+	ret = kcylon_setup();
+	if (ret) {
+		printk(KERN_INFO "KCYLON: Couldn't apply the config (%d), restoring the previous one\n", ret);
+		kcylon_config_load(old);
+		if (kcylon_setup())
+			printk(KERN_ALERT "KCYLON: Couldn't restore the previous config\n");
+	} else {
+		printk(KERN_INFO "KCYLON: Applied a config in %lld us\n", ktime_us_delta(ktime_get(), start));
+	}
+	WRITE_ONCE(config_applying, false);
+	mutex_unlock(&config_mutex);
+	mutex_unlock(&replay_mutex);
+	kfree(old);
+	return ret;
+}
+
+/**
+ * @brief Snapshots the current configuration when
+ * /dev/kcylon_config is opened
+ */
+static int kcylon_config_open(struct inode *inode, struct file *file)
+{
+	struct kcylon_config *cfg = kmalloc(sizeof(*cfg), GFP_KERNEL);
+	if (!cfg)
+		return -ENOMEM;
+	mutex_lock(&config_mutex);
+	kcylon_config_export(cfg);
+	mutex_unlock(&config_mutex);
+	file->private_data = cfg;
+	return 0;
+}
+
+static ssize_t kcylon_config_read(struct file *file, char __user *ubuf, size_t len, loff_t *ppos)
+{
+	return simple_read_from_buffer(ubuf, len, ppos, file->private_data, sizeof(struct kcylon_config));
+}
+
+/**
+ * @brief Applies a config blob, which must be written whole
+ * in a single write
+ */
+static ssize_t kcylon_config_write(struct file *file, const char __user *ubuf, size_t len, loff_t *ppos)
+{
+	struct kcylon_config *cfg;
+	int ret;
+	if (*ppos || len != sizeof(*cfg))
+		return -EINVAL;
+	cfg = memdup_user(ubuf, len);
+	if (IS_ERR(cfg))
+		return PTR_ERR(cfg);
+	ret = kcylon_config_apply(cfg);
+	kfree(cfg);
+	return ret ? ret : len;
+}
+
+static int kcylon_config_release(struct inode *inode, struct file *file)
+{
+	kfree(file->private_data);
+	return 0;
+}
+
+static const struct file_operations kcylon_config_fops = {
+	.owner = THIS_MODULE,
+	.open = kcylon_config_open,
+	.read = kcylon_config_read,
+	.write = kcylon_config_write,
+	.release = kcylon_config_release,
+};
+
+static struct miscdevice kcylon_config_misc = {
+	.minor = MISC_DYNAMIC_MINOR,
+	.name = "kcylon_config",
+	.fops = &kcylon_config_fops,
+	.mode = 0600,
+};
+
+/**
+ * @brief Loads the config blob named by the config parameter
+ *
+ * @return returns 0 on success, a negative errno otherwise
+ */
+static int kcylon_config_firmware(void)
+{
+	const struct firmware *fw;
+	int ret = request_firmware(&fw, config, kcylon_config_misc.this_device);
+	if (ret) {
+		printk(KERN_INFO "KCYLON: Couldn't load the config %s\n", config);
+		return ret;
+	}
+	ret = fw->size == sizeof(struct kcylon_config) ?
+	      kcylon_config_check((const struct kcylon_config *)fw->data) : -EINVAL;
+	if (ret)
+		printk(KERN_INFO "KCYLON: Rejected a malformed config\n");
+	else
+		kcylon_config_load((const struct kcylon_config *)fw->data);
+	release_firmware(fw);
+	return ret;
+}
+
+/**
+ * @brief Kernel module entry point
+ * Sets up all of the GPIOs and the button
+ * interrupts
+ *
+ * @return returns 0 on success, a negative errno otherwise
+ */
+static int __init kcylon_init(void)
+{
+	ktime_t start;
+	int ret = 0;
+	printk(KERN_INFO "KCYLON: Initializing kcylon module\n");
+	kcylon_speed_table_fill();
+
+	if (misc_register(&kcylon_config_misc)) {
+		printk(KERN_INFO "KCYLON: Couldn't register /dev/kcylon_config\n");
+		return -ENODEV;
+	}
+	start = ktime_get();
+	/* the device is live, so a config may be written already */
+	mutex_lock(&config_mutex);
+	if (config)
+		ret = kcylon_config_firmware();
+	if (!ret)
+		ret = kcylon_setup();
+	if (ret) {
+		misc_deregister(&kcylon_config_misc);
+		mutex_unlock(&config_mutex);
+		return ret;
+	}
+	mutex_unlock(&config_mutex);
+	if (config)
+		printk(KERN_INFO "KCYLON: Applied the config %s in %lld us\n", config,
+		       ktime_us_delta(ktime_get(), start));
+
+	ret = kcylon_matrix_init();
+	if (ret)
+		goto teardown;
+
+	ret = misc_register(&kcylon_misc);
+	if (ret) {
+		printk(KERN_INFO "KCYLON: Couldn't register /dev/kcylon\n");
+		goto matrix_exit;
 	}
+
+	debug_dir = debugfs_create_dir("kcylon", NULL);
+	debugfs_create_file("stats", 0444, debug_dir, NULL, &kcylon_stats_fops);
+	debugfs_create_file("overlay", 0200, debug_dir, NULL, &kcylon_overlay_fops);
+	debugfs_create_file("trace", 0400, debug_dir, NULL, &kcylon_trace_fops);
+	debugfs_create_file("replay", 0200, debug_dir, NULL, &kcylon_replay_fops);
+	debugfs_create_file("ontime", 0444, debug_dir, NULL, &kcylon_ontime_fops);
+	return 0;
+
+matrix_exit:
+	kcylon_matrix_exit();
+teardown:
+	misc_deregister(&kcylon_config_misc);
+	mutex_lock(&config_mutex);
+	kcylon_teardown();
+	mutex_unlock(&config_mutex);
 	return ret;
 }
 
@@ -189,39 +3253,69 @@ static int __init kcylon_init(void)
  */
 static void __exit kcylon_exit(void)
 {
-	int i;
-	kthread_stop(task);
-	for (i = 0; i < NUM_LEDS; i++) {
-		gpio_set_value(led_pins[i], 0);
-		gpio_unexport(led_pins[i]);
-		gpio_free(led_pins[i]);
-	}
-	free_irq(irq_number, NULL);
-	gpio_unexport(button_pin);
-	gpio_free(button_pin);
+	misc_deregister(&kcylon_misc);
+	misc_deregister(&kcylon_config_misc);
+	debugfs_remove_recursive(debug_dir);
+	mutex_lock(&replay_mutex);
+	kcylon_replay_stop();
+	mutex_unlock(&replay_mutex);
+	kcylon_matrix_exit();
+	mutex_lock(&config_mutex);
+	kcylon_teardown();
+	mutex_unlock(&config_mutex);
 	printk(KERN_INFO "KCYLON: Goodbye!\n");
 }
 
 /**
  * @brief Kernel module interrupt handler
- *  Changes the button level when a button
- *  is pressed. Also it puts limits on the level.
+ *  Timestamps the button press and defers the
+ *  work to the IRQ thread.
+ *
+ * @param irq The irq number that identifies the button
+ * @return returns IRQ_WAKE_THREAD so kcylon_irq_thread() handles the press
+ */
+static irqreturn_t kcylon_irq_handler(int irq, void *dev_id)
+{
+	ktime_t now = ktime_get();
+	press_edge = now;
+	press_interval_ns = ktime_to_ns(ktime_sub(now, press_last));
+	press_last = now;
+	/* a burst of edges masks the line and polls it instead */
+	if (ktime_after(now, ktime_add_ms(button_burst_start, poll_window_ms))) {
+		button_burst_start = now;
+		button_burst = 0;
+	}
+	if (poll_burst && ++button_burst >= poll_burst && !gpio_cansleep(button_pin) &&
+	    !READ_ONCE(button_stopping)) {
+		disable_irq_nosync(irq);
+		WRITE_ONCE(button_polling, true);
+		button_poll_level = 1;
+		button_poll_edge = now;
+		hrtimer_start(&button_poll_timer, us_to_ktime(max(poll_interval_us, 100U)), HRTIMER_MODE_REL_PINNED);
+	}
+	this_cpu_inc(strips[0].stats->irqs);
+	this_cpu_add(strips[0].stats->irq_ns, ktime_to_ns(ktime_sub(ktime_get(), now)));
+	return IRQ_WAKE_THREAD;
+}
+
+/**
+ * @brief Kernel module interrupt thread
+ *  Applies the button press. The press
+ *  is acknowledged on the strip right
+ *  away rather than at the next frame.
  *
  * @param irq The irq number that identifies the button
  * @return returns IRQ_HANDLED which tells the kernel that this is a non-fatal interrupt
  */
-static irq_handler_t kcylon_irq_handler(unsigned int irq, void *dev_id, struct pt_regs *regs)
-{
-	mutex_lock(&button_level_mutex);
-	button_level += button_direction;
-	if (button_level == 10 || button_level == -10)
-		button_direction *= -1;
-	mutex_unlock(&button_level_mutex);
-	getnstimeofday(&ts_current);
-	ts_diff = timespec_sub(ts_current, ts_last);
-	ts_last = ts_current;
-	printk(KERN_INFO "KCYLON: Interrupt received (button level %d)\n", button_level);
-	return (irq_handler_t) IRQ_HANDLED;
+static irqreturn_t kcylon_irq_thread(int irq, void *dev_id)
+{
+	ktime_t start = ktime_get();
+	int level = kcylon_strip_command(0, button_segment, KCYLON_CMD_PRESS, KCYLON_SRC_BUTTON,
+					 press_edge, NULL);
+	this_cpu_add(strips[0].stats->irq_ns, ktime_to_ns(ktime_sub(ktime_get(), start)));
+	kcylon_strip_ack(&strips[0], press_edge);
+	printk(KERN_INFO "KCYLON: Interrupt received (button level %d)\n", level);
+	return IRQ_HANDLED;
 }
 #undef NUM_LEDS
 